@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "Admission.h"
+#include "Server.h"
+#include "Memory.h"
+#include "Trace.h"
+using namespace std;
+
+/* Once this many clients are tracked, buckets that have refilled are dropped */
+#define BUCKET_TABLE_PRUNE 4096
+
+struct token_bucket
+{
+	double requests;
+	double bytes;
+	double last_refill;
+};
+
+struct pending_conn
+{
+	int    connfd;
+	double enqueued;
+};
+
+static struct admission_config config;
+static void (*service)(int, int);
+static int service_param;
+static bool threaded;
+
+static mutex bucket_mtx;
+static unordered_map<in_addr_t, token_bucket> buckets;
+
+static mutex queue_mtx;
+static condition_variable queue_cv;
+static deque<pending_conn> pending;
+static int active = 0;
+static condition_variable idle_cv;
+
+static atomic<long> admitted(0);
+static atomic<long> served(0);
+static atomic<long> shed_queue_full(0);
+static atomic<long> shed_deadline(0);
+static atomic<long> throttled_requests(0);
+static atomic<long> throttled_bytes(0);
+static atomic<long> bytes_charged(0);
+
+static double now_seconds(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void refill(token_bucket* bucket, double now){
+	double elapsed = now - bucket->last_refill;
+	bucket->last_refill = now;
+	if(config.req_rate > 0){
+		bucket->requests += elapsed * config.req_rate;
+		if(bucket->requests > config.req_rate){
+			bucket->requests = config.req_rate;
+		}
+	}
+	if(config.byte_rate > 0){
+		bucket->bytes += elapsed * config.byte_rate;
+		if(bucket->bytes > config.byte_rate){
+			bucket->bytes = config.byte_rate;
+		}
+	}
+}
+
+/*
+ * Forget clients whose buckets are full again - they carry no state that a
+ * freshly created bucket wouldn't.
+ */
+static void prune_buckets(double now){
+	for(auto it = buckets.begin(); it != buckets.end(); ){
+		refill(&it->second, now);
+		if((config.req_rate <= 0 || it->second.requests >= config.req_rate) &&
+			(config.byte_rate <= 0 || it->second.bytes >= config.byte_rate)){
+			it = buckets.erase(it);
+		}
+		else{
+			++it;
+		}
+	}
+}
+
+static token_bucket* find_bucket(in_addr_t client, double now){
+	auto it = buckets.find(client);
+	if(it == buckets.end()){
+		if(buckets.size() >= BUCKET_TABLE_PRUNE){
+			prune_buckets(now);
+		}
+		token_bucket fresh = { config.req_rate, config.byte_rate, now };
+		it = buckets.emplace(client, fresh).first;
+	}
+	else{
+		refill(&it->second, now);
+	}
+	return &it->second;
+}
+
+static void reject(int connfd){
+	write_error(connfd, EBUSY);
+	if(close(connfd) < 0){
+		perror("Error closing rejected connection");
+	}
+}
+
+static void serve(int connfd){
+	trace_request();
+	trace_begin(TRACE_REQUEST);
+	service(connfd, service_param);
+	trace_end(TRACE_REQUEST);
+	arena_reset();
+	served++;
+	if(close(connfd) < 0){
+		perror("Error in close()");
+	}
+}
+
+static void worker(){
+	while(1){
+		unique_lock<mutex> lock(queue_mtx);
+		queue_cv.wait(lock, []{ return !pending.empty(); });
+		pending_conn conn = pending.front();
+		pending.pop_front();
+		active++;
+		lock.unlock();
+
+		/*
+			A connection that sat in the queue past its deadline has most likely
+			been given up on by the client - don't spend a worker on it
+		*/
+		if(config.deadline_ms > 0 && (now_seconds() - conn.enqueued) * 1000 > config.deadline_ms){
+			shed_deadline++;
+			reject(conn.connfd);
+		}
+		else{
+			serve(conn.connfd);
+		}
+
+		lock.lock();
+		active--;
+		if(pending.empty() && !active){
+			idle_cv.notify_all();
+		}
+	}
+}
+
+void admission_init(struct admission_config *cfg, void (*service_function)(int, int), int param, bool multithread){
+	config = *cfg;
+	service = service_function;
+	service_param = param;
+	threaded = multithread;
+	if(multithread){
+		for(int i = 0; i < config.max_conns; i++){
+			thread(worker).detach();
+		}
+	}
+}
+
+bool admission_admit(int connfd, in_addr_t client){
+	if(config.req_rate <= 0 && config.byte_rate <= 0){
+		admitted++;
+		return true;
+	}
+	bucket_mtx.lock();
+	token_bucket* bucket = find_bucket(client, now_seconds());
+	bool over_requests = config.req_rate > 0 && bucket->requests < 1;
+	bool over_bytes = config.byte_rate > 0 && bucket->bytes < 0;
+	if(!over_requests && !over_bytes && config.req_rate > 0){
+		bucket->requests -= 1;
+	}
+	bucket_mtx.unlock();
+
+	if(over_requests || over_bytes){
+		if(over_requests){
+			throttled_requests++;
+		}
+		else{
+			throttled_bytes++;
+		}
+		reject(connfd);
+		return false;
+	}
+	admitted++;
+	return true;
+}
+
+bool admission_submit(int connfd){
+	if(!threaded){
+		serve(connfd);
+		return true;
+	}
+	queue_mtx.lock();
+	if((int)pending.size() >= config.queue_len){
+		queue_mtx.unlock();
+		shed_queue_full++;
+		reject(connfd);
+		return false;
+	}
+	pending.push_back({ connfd, now_seconds() });
+	queue_mtx.unlock();
+	queue_cv.notify_one();
+	return true;
+}
+
+bool admission_drain(int timeout){
+	unique_lock<mutex> lock(queue_mtx);
+	return idle_cv.wait_for(lock, chrono::seconds(timeout), []{ return pending.empty() && !active; });
+}
+
+void admission_charge(int connfd, long bytes){
+	bytes_charged += bytes;
+	if(config.byte_rate <= 0){
+		return;
+	}
+	struct sockaddr_in clientaddr;
+	socklen_t clientlen = sizeof(clientaddr);
+	if(getpeername(connfd, (struct sockaddr *)&clientaddr, &clientlen) < 0){
+		return;
+	}
+	bucket_mtx.lock();
+	find_bucket(clientaddr.sin_addr.s_addr, now_seconds())->bytes -= bytes;
+	bucket_mtx.unlock();
+}
+
+void admission_print_stats(FILE *out){
+	queue_mtx.lock();
+	size_t queued = pending.size();
+	queue_mtx.unlock();
+	fprintf(out, "admission: admitted %ld served %ld queued %zu bytes %ld\n",
+		admitted.load(), served.load(), queued, bytes_charged.load());
+	fprintf(out, "admission: shed %ld (queue full %ld, deadline %ld) throttled %ld (requests %ld, bytes %ld)\n",
+		shed_queue_full.load() + shed_deadline.load(), shed_queue_full.load(), shed_deadline.load(),
+		throttled_requests.load() + throttled_bytes.load(), throttled_requests.load(), throttled_bytes.load());
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdio.h>
+
+/*
+ * Limits applied to incoming connections before they reach file_server().
+ * A rate of 0 disables that limit.
+ */
+struct admission_config
+{
+	int    max_conns;    /* worker threads, i.e. concurrent connections */
+	int    queue_len;    /* accepted connections waiting for a worker */
+	int    deadline_ms;  /* queued connections older than this are shed */
+	double req_rate;     /* per-client-IP requests per second */
+	double byte_rate;    /* per-client-IP bytes per second */
+};
+
+/*
+ * admission_init() - record the limits and, if multithread is set, start
+ *                    max_conns workers that pass each admitted connection to
+ *                    service_function
+ */
+void admission_init(struct admission_config *cfg, void (*service_function)(int, int), int param, bool multithread);
+
+/*
+ * admission_admit() - charge one request to the client's token bucket.
+ *                     Returns false (and replies EBUSY) if the client is over
+ *                     its request or byte budget.
+ */
+bool admission_admit(int connfd, in_addr_t client);
+
+/*
+ * admission_submit() - queue an admitted connection for the worker pool, or
+ *                      serve it right away when not multithreaded.  Returns
+ *                      false (and replies EBUSY) if the queue is full.  The
+ *                      connection is closed by whoever ends up owning it.
+ */
+bool admission_submit(int connfd);
+
+/*
+ * admission_charge() - charge bytes moved on connfd to its client's byte
+ *                      bucket.  The bucket may go into debt; further requests
+ *                      from that client are throttled until it refills.
+ */
+void admission_charge(int connfd, long bytes);
+
+/*
+ * admission_drain() - wait up to timeout seconds for queued and running
+ *                     connections to finish.  Returns true if they all did.
+ */
+bool admission_drain(int timeout);
+
+/*
+ * admission_print_stats() - dump admission counters
+ */
+void admission_print_stats(FILE *out);
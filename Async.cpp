@@ -0,0 +1,459 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Async.h"
+#include "LargeIO.h"
+#include "Memory.h"
+#include "Server.h"
+#include "Trace.h"
+using namespace std;
+
+/* Readiness events taken from epoll per wakeup */
+#define LOOP_EVENTS 256
+
+/* Milliseconds between scans for connections that have waited too long */
+#define TIMEOUT_SCAN 1000
+
+/*
+	Each loop owns an epoll set with every one of its sockets registered
+	edge-triggered, once, plus an eventfd that other threads write to when
+	they hand it a new connection or a finished offload job
+*/
+struct async_loop
+{
+	int                             epfd;
+	int                             wakefd;
+	mutex                           mtx;
+	vector<int>                     incoming;
+	vector<struct async_offload *>  finished;
+	struct async_socket            *sockets;
+	vector<struct async_socket *>   retired;
+};
+
+/*
+	The coroutine at the root of each connection.  It starts as soon as it is
+	called, and its frame goes away by itself when it returns.
+*/
+struct async_detached
+{
+	struct promise_type
+	{
+		async_detached get_return_object() { return {}; }
+		suspend_never initial_suspend() noexcept { return {}; }
+		suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { terminate(); }
+	};
+};
+
+static struct async_config config;
+static async<void> (*handler)(struct async_socket *);
+static void (*fallback)(int, int);
+static int fallback_param;
+static bool enabled = false;
+
+static vector<struct async_loop *> loops;
+static atomic<unsigned> next_loop(0);
+static thread_local struct async_loop *current_loop = NULL;
+
+static mutex offload_mtx;
+static condition_variable offload_cv;
+static deque<struct async_offload *> offload_queue;
+
+static mutex drain_mtx;
+static condition_variable drain_cv;
+static atomic<long> in_flight(0);
+static atomic<long> peak_in_flight(0);
+static atomic<long> served(0);
+static atomic<long> rejected(0);
+static atomic<long> offloaded(0);
+static atomic<long> timeouts(0);
+
+static double now_seconds(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wake(struct async_loop *loop){
+	uint64_t one = 1;
+	if(write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+		perror("Error waking event loop");
+	}
+}
+
+/*
+	A loop interleaves many connections, so a connection's request span is
+	recorded as one slice per stretch it runs on the loop: it ends wherever
+	the coroutine suspends, and begins again, with the connection's id,
+	wherever the loop resumes it.  The spans inside a slice never cross a
+	suspension either, so every thread's spans still nest.
+*/
+static void resume_request(uint64_t request, coroutine_handle<> handle){
+	trace_resume(request);
+	trace_begin(TRACE_REQUEST);
+	handle.resume();
+}
+
+/*
+	Parks the calling coroutine until its socket is ready, or until it has
+	waited idle_timeout seconds.  Resumes true unless it timed out.
+*/
+struct socket_ready
+{
+	struct async_socket *sock;
+
+	bool await_ready() { return false; }
+	void await_suspend(coroutine_handle<> handle) {
+		sock->waiter = handle;
+		sock->deadline = now_seconds() + config.idle_timeout;
+		trace_end(TRACE_REQUEST);
+	}
+	bool await_resume() {
+		sock->waiter = nullptr;
+		if(sock->timed_out){
+			sock->timed_out = false;
+			return false;
+		}
+		return true;
+	}
+};
+
+async<long> async_read_some(struct async_socket *sock, char *buffer, long size, int flags){
+	while(1){
+		trace_begin(TRACE_RECV);
+		long count = recv(sock->fd, buffer, size, flags);
+		trace_end(TRACE_RECV);
+		if(count >= 0){
+			co_return count;
+		}
+		if(errno == EINTR){
+			continue;
+		}
+		if(errno != EAGAIN && errno != EWOULDBLOCK){
+			co_return -1;
+		}
+		if(!co_await socket_ready{ sock }){
+			errno = ETIMEDOUT;
+			co_return -1;
+		}
+	}
+}
+
+async<bool> async_write_all(struct async_socket *sock, const char *data, long size){
+	long written = 0;
+	while(written < size){
+		trace_begin(TRACE_SEND);
+		long count = send(sock->fd, data + written, size - written, MSG_NOSIGNAL);
+		trace_end(TRACE_SEND);
+		if(count > 0){
+			written += count;
+			continue;
+		}
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+			co_return false;
+		}
+		if(!co_await socket_ready{ sock }){
+			co_return false;
+		}
+	}
+	co_return true;
+}
+
+async<bool> async_send_large(struct async_socket *sock, int fd, long file_size, char *block){
+	for(long offset = 0; offset < file_size; offset += LARGE_IO_BLOCK){
+		long length = file_size - offset < LARGE_IO_BLOCK ? file_size - offset : LARGE_IO_BLOCK;
+		bool read = false;
+		co_await async_offload([&]{
+			trace_begin(TRACE_DISK_READ);
+			read = large_read_block(fd, block, offset, length);
+			trace_end(TRACE_DISK_READ);
+		});
+		if(!read || !co_await async_write_all(sock, block, length)){
+			co_return false;
+		}
+	}
+	co_return true;
+}
+
+void async_offload::await_suspend(coroutine_handle<> h){
+	handle = h;
+	loop = current_loop;
+	request = trace_current();
+	trace_end(TRACE_REQUEST);
+	offloaded++;
+	offload_mtx.lock();
+	offload_queue.push_back(this);
+	offload_mtx.unlock();
+	offload_cv.notify_one();
+}
+
+/* offload threads run each job as a slice of the request that offloaded it, and pass the coroutine back to its loop */
+static void offload_worker(){
+	while(1){
+		unique_lock<mutex> lock(offload_mtx);
+		offload_cv.wait(lock, []{ return !offload_queue.empty(); });
+		struct async_offload *offload = offload_queue.front();
+		offload_queue.pop_front();
+		lock.unlock();
+
+		trace_resume(offload->request);
+		trace_begin(TRACE_REQUEST);
+		offload->job();
+		trace_end(TRACE_REQUEST);
+		arena_reset();
+
+		struct async_loop *loop = offload->loop;
+		loop->mtx.lock();
+		loop->finished.push_back(offload);
+		loop->mtx.unlock();
+		wake(loop);
+	}
+}
+
+static void serve_blocking(int connfd){
+	int flags = fcntl(connfd, F_GETFL);
+	fcntl(connfd, F_SETFL, flags & ~O_NONBLOCK);
+	fallback(connfd, fallback_param);
+}
+
+async<void> async_fallback(struct async_socket *sock){
+	/* the socket's idle timeouts were set by the accept loop, and apply again once it blocks */
+	int connfd = sock->fd;
+	co_await async_offload([connfd]{ serve_blocking(connfd); });
+}
+
+static void link_socket(struct async_loop *loop, struct async_socket *sock){
+	sock->prev = NULL;
+	sock->next = loop->sockets;
+	if(loop->sockets){
+		loop->sockets->prev = sock;
+	}
+	loop->sockets = sock;
+}
+
+static void unlink_socket(struct async_loop *loop, struct async_socket *sock){
+	if(sock->prev){
+		sock->prev->next = sock->next;
+	}
+	else{
+		loop->sockets = sock->next;
+	}
+	if(sock->next){
+		sock->next->prev = sock->prev;
+	}
+}
+
+/*
+	The socket isn't freed here: an event for it may still be further along
+	in the batch the loop is working through, so it is freed after the batch
+*/
+static void retire(struct async_socket *sock){
+	struct async_loop *loop = sock->loop;
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sock->fd, NULL);
+	if(close(sock->fd) < 0){
+		perror("Error in close()");
+	}
+	unlink_socket(loop, sock);
+	loop->retired.push_back(sock);
+	served++;
+	if(--in_flight == 0){
+		drain_mtx.lock();
+		drain_mtx.unlock();
+		drain_cv.notify_all();
+	}
+}
+
+static async_detached run_connection(struct async_loop *loop, int connfd){
+	struct async_socket *sock = new async_socket();
+	sock->fd = connfd;
+	sock->loop = loop;
+	sock->waiter = nullptr;
+	sock->deadline = 0;
+	sock->timed_out = false;
+	sock->request = trace_request();
+	trace_begin(TRACE_REQUEST);
+	link_socket(loop, sock);
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = sock;
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &event) < 0){
+		perror("Error registering connection");
+	}
+	else{
+		co_await handler(sock);
+	}
+	retire(sock);
+	trace_end(TRACE_REQUEST);
+}
+
+/* wake every waiter that has been parked longer than idle_timeout */
+static void expire_waiters(struct async_loop *loop){
+	double now = now_seconds();
+	vector<struct async_socket *> expired;
+	for(struct async_socket *sock = loop->sockets; sock; sock = sock->next){
+		if(sock->waiter && sock->deadline <= now){
+			expired.push_back(sock);
+		}
+	}
+	for(struct async_socket *sock : expired){
+		if(sock->waiter){
+			timeouts++;
+			sock->timed_out = true;
+			coroutine_handle<> waiter = sock->waiter;
+			sock->waiter = nullptr;
+			resume_request(sock->request, waiter);
+		}
+	}
+}
+
+static void run_loop(struct async_loop *loop){
+	current_loop = loop;
+	struct epoll_event events[LOOP_EVENTS];
+	double next_scan = now_seconds() + TIMEOUT_SCAN / 1000.0;
+	vector<int> incoming;
+	vector<struct async_offload *> finished;
+	while(1){
+		int ready = epoll_wait(loop->epfd, events, LOOP_EVENTS, TIMEOUT_SCAN);
+		if(ready < 0 && errno != EINTR){
+			perror("Error in epoll_wait()");
+			continue;
+		}
+
+		/*
+			An event with no waiter is dropped: a coroutine always tries its
+			socket before parking, so it can't miss readiness that came earlier
+		*/
+		for(int i = 0; i < ready; i++){
+			struct async_socket *sock = (struct async_socket *)events[i].data.ptr;
+			if(!sock){
+				uint64_t count;
+				if(read(loop->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+					perror("Error reading event loop wakeups");
+				}
+				continue;
+			}
+			if(sock->waiter){
+				coroutine_handle<> waiter = sock->waiter;
+				sock->waiter = nullptr;
+				resume_request(sock->request, waiter);
+			}
+		}
+
+		loop->mtx.lock();
+		incoming.swap(loop->incoming);
+		finished.swap(loop->finished);
+		loop->mtx.unlock();
+		for(struct async_offload *offload : finished){
+			resume_request(offload->request, offload->handle);
+		}
+		finished.clear();
+		for(int connfd : incoming){
+			run_connection(loop, connfd);
+		}
+		incoming.clear();
+
+		if(now_seconds() >= next_scan){
+			expire_waiters(loop);
+			next_scan = now_seconds() + TIMEOUT_SCAN / 1000.0;
+		}
+		for(struct async_socket *sock : loop->retired){
+			delete sock;
+		}
+		loop->retired.clear();
+	}
+}
+
+void async_init(struct async_config *cfg, async<void> (*handler_function)(struct async_socket *),
+	void (*fallback_function)(int, int), int param){
+	config = *cfg;
+	handler = handler_function;
+	fallback = fallback_function;
+	fallback_param = param;
+
+	/* every connection in flight holds a descriptor, so take all that we're allowed */
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max){
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	for(int i = 0; i < config.offload_threads; i++){
+		thread(offload_worker).detach();
+	}
+	for(int i = 0; i < config.loops; i++){
+		struct async_loop *loop = new async_loop();
+		loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+		loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		loop->sockets = NULL;
+		if(loop->epfd < 0 || loop->wakefd < 0){
+			die("Error creating event loop: ", strerror(errno));
+		}
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &event);
+		loops.push_back(loop);
+		thread(run_loop, loop).detach();
+	}
+	enabled = true;
+}
+
+bool async_enabled(){
+	return enabled;
+}
+
+bool async_submit(int connfd){
+	long now_in_flight = ++in_flight;
+	if(now_in_flight > config.max_conns){
+		in_flight--;
+		rejected++;
+		write_error(connfd, EBUSY);
+		if(close(connfd) < 0){
+			perror("Error closing rejected connection");
+		}
+		return false;
+	}
+	long peak = peak_in_flight.load();
+	while(now_in_flight > peak && !peak_in_flight.compare_exchange_weak(peak, now_in_flight)){
+	}
+	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+	struct async_loop *loop = loops[next_loop++ % loops.size()];
+	loop->mtx.lock();
+	loop->incoming.push_back(connfd);
+	loop->mtx.unlock();
+	wake(loop);
+	return true;
+}
+
+bool async_drain(int timeout){
+	unique_lock<mutex> lock(drain_mtx);
+	return drain_cv.wait_for(lock, chrono::seconds(timeout), []{ return in_flight.load() == 0; });
+}
+
+void async_print_stats(FILE *out){
+	if(!enabled){
+		return;
+	}
+	fprintf(out, "async: %zu loops, %ld connections served, %ld in flight (peak %ld), %ld rejected\n",
+		loops.size(), served.load(), in_flight.load(), peak_in_flight.load(), rejected.load());
+	fprintf(out, "async: %ld operations offloaded to %d threads, %ld waits timed out\n",
+		offloaded.load(), config.offload_threads, timeouts.load());
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+/*
+ * async<T> - a coroutine producing a T.  It doesn't run until it is
+ * co_awaited, and when it finishes it resumes whoever awaited it, so a
+ * handler can be written as the straight-line chain of calls it would be
+ * with blocking I/O, with a co_await wherever it may have to wait.
+ */
+template<typename T> struct async;
+
+struct async_promise_base
+{
+	std::coroutine_handle<> continuation;
+
+	struct final_awaiter
+	{
+		bool await_ready() noexcept { return false; }
+		template<typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+			std::coroutine_handle<> next = handle.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { std::terminate(); }
+};
+
+template<typename T>
+struct async_promise : async_promise_base
+{
+	T value;
+	async<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+};
+
+template<>
+struct async_promise<void> : async_promise_base
+{
+	async<void> get_return_object();
+	void return_void() {}
+};
+
+template<typename T>
+struct async
+{
+	typedef async_promise<T> promise_type;
+	std::coroutine_handle<promise_type> handle;
+
+	explicit async(std::coroutine_handle<promise_type> h) : handle(h) {}
+	async(async &&other) : handle(std::exchange(other.handle, nullptr)) {}
+	async(const async &) = delete;
+	~async() {
+		if(handle){
+			handle.destroy();
+		}
+	}
+
+	/* awaiting starts the coroutine, and it hands control straight back when done */
+	bool await_ready() { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+		handle.promise().continuation = awaiter;
+		return handle;
+	}
+	T await_resume() {
+		if constexpr (!std::is_void_v<T>){
+			return std::move(handle.promise().value);
+		}
+	}
+};
+
+template<typename T>
+inline async<T> async_promise<T>::get_return_object() {
+	return async<T>(std::coroutine_handle<async_promise<T>>::from_promise(*this));
+}
+
+inline async<void> async_promise<void>::get_return_object() {
+	return async<void>(std::coroutine_handle<async_promise<void>>::from_promise(*this));
+}
+
+/*
+ * One client connection, owned by the event loop that serves it.  Its
+ * socket is non-blocking and registered with the loop for as long as the
+ * connection lives.
+ */
+struct async_loop;
+
+struct async_socket
+{
+	int                     fd;
+	struct async_loop      *loop;
+	std::coroutine_handle<> waiter;    /* parked until fd is ready, or NULL */
+	double                  deadline;  /* when the parked waiter gives up */
+	bool                    timed_out;
+	uint64_t                request;   /* trace id, kept for the whole connection */
+	struct async_socket    *prev;
+	struct async_socket    *next;
+};
+
+/*
+ * Sizes of the async layer.  max_conns counts connections in flight at
+ * once, not threads: a connection waiting on its client holds no thread.
+ */
+struct async_config
+{
+	int loops;            /* event loop threads */
+	int offload_threads;  /* threads running blocking file operations */
+	int max_conns;        /* connections in flight before new ones get EBUSY */
+	int idle_timeout;     /* seconds a connection may wait on its client */
+};
+
+/*
+ * async_init() - start the event loops and the offload pool.  Each admitted
+ *                connection is served by handler on one loop; handler may
+ *                pass it to async_fallback(), which runs
+ *                fallback(connfd, param) on the offload pool.
+ */
+void async_init(struct async_config *cfg, async<void> (*handler)(struct async_socket *), void (*fallback)(int, int),
+	int param);
+
+/*
+ * async_enabled() - true once async_init() has run
+ */
+bool async_enabled();
+
+/*
+ * async_submit() - hand an admitted connection to the next event loop.
+ *                  Returns false (and replies EBUSY) if max_conns are already
+ *                  in flight.  The loop closes the connection when done.
+ */
+bool async_submit(int connfd);
+
+/*
+ * async_read_some() - receive up to size bytes, waiting for the client if
+ *                     none have arrived.  Returns the count, 0 if the client
+ *                     hung up, or -1 with errno set (ETIMEDOUT if it went
+ *                     quiet for longer than idle_timeout).
+ */
+async<long> async_read_some(struct async_socket *sock, char *buffer, long size, int flags = 0);
+
+/*
+ * async_write_all() - send all size bytes, waiting whenever the socket
+ *                     buffer is full.  Returns false if the client went away.
+ */
+async<bool> async_write_all(struct async_socket *sock, const char *data, long size);
+
+/*
+ * async_send_large() - send file_size bytes of fd, a file opened with
+ *                      large_open(), through block, an aligned block from
+ *                      large_block_take().  Each block is read on the
+ *                      offload pool and dropped from the page cache, as
+ *                      large_send() does, and then sent from the loop.
+ */
+async<bool> async_send_large(struct async_socket *sock, int fd, long file_size, char *block);
+
+/*
+ * async_offload() - run job on the offload pool, for file operations that
+ *                   may block on the disk or on a lock, and resume on this
+ *                   loop once it has finished.  The job's request scratch
+ *                   memory is released after it returns.
+ */
+struct async_offload
+{
+	std::function<void()>   job;
+	std::coroutine_handle<> handle;
+	struct async_loop      *loop;
+	uint64_t                request;   /* trace id of the coroutine that offloaded it */
+
+	explicit async_offload(std::function<void()> f) : job(std::move(f)), loop(NULL), request(0) {}
+	bool await_ready() { return false; }
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() {}
+};
+
+/*
+ * async_fallback() - serve the connection with the blocking service function
+ *                    on the offload pool, for requests that have no handler
+ *                    of their own.  Nothing must have been read from it yet.
+ */
+async<void> async_fallback(struct async_socket *sock);
+
+/*
+ * async_drain() - wait up to timeout seconds for the connections in flight
+ *                 to finish.  Returns true if they all did.
+ */
+bool async_drain(int timeout);
+
+/*
+ * async_print_stats() - dump connection, offload and timeout counts
+ */
+void async_print_stats(FILE *out);
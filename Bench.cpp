@@ -0,0 +1,376 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "support.h"
+#include "Bench.h"
+#include "Pipeline.h"
+#include "Ring.h"
+using namespace std;
+
+void help(char *progname)
+{
+	printf("Usage: %s [OPTIONS]\n", progname);
+	printf("Measure small-file GET latency while large files stream through a file server\n");
+	printf("  -s    server info (IP or hostname)\n");
+	printf("  -p    port on which to contact server\n");
+	printf("  -n    number of small files (default 100)\n");
+	printf("  -k    size of each small file in bytes (default 4096)\n");
+	printf("  -t    threads issuing small GETs (default 4)\n");
+	printf("  -L    size of the large file in bytes (default 0 = no large traffic)\n");
+	printf("  -l    threads streaming the large file (default 1)\n");
+	printf("  -d    seconds to run (default 10)\n");
+	printf("  -R    ring file listing the cluster's servers, instead of -s and -p\n");
+	printf("  -N    with -R, servers each file is replicated to (default 1)\n");
+	printf("  -M    microbenchmark the hashing each command does, on this many in-memory -k byte files, instead\n");
+}
+
+void die(const char *msg1, const char *msg2)
+{
+	fprintf(stderr, "%s, %s\n", msg1, msg2);
+	exit(0);
+}
+
+static double now_seconds(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * connect_to_server() - open a connection to the server specified by the
+ *                       parameters
+ */
+int connect_to_server(char *server, int port)
+{
+	int clientfd;
+	struct hostent *hp;
+	struct sockaddr_in serveraddr;
+	char errbuf[256];
+
+	if((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		die("Error creating socket: ", strerror(errno));
+	}
+	if((hp = gethostbyname(server)) == NULL)
+	{
+		sprintf(errbuf, "%d", h_errno);
+		die("DNS error: DNS error ", errbuf);
+	}
+	bzero((char *) &serveraddr, sizeof(serveraddr));
+	serveraddr.sin_family = AF_INET;
+	bcopy((char *)hp->h_addr_list[0], (char *)&serveraddr.sin_addr.s_addr, hp->h_length);
+	serveraddr.sin_port = htons(port);
+	if(connect(clientfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0)
+	{
+		die("Error connecting: ", strerror(errno));
+	}
+	return clientfd;
+}
+
+static bool write_all(int fd, const char* data, long int size){
+	while(size > 0){
+		long int count = write(fd, data, size);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			return false;
+		}
+		data += count;
+		size -= count;
+	}
+	return true;
+}
+
+static bool read_all(int fd, char* data, long int size){
+	while(size > 0){
+		long int count = read(fd, data, size);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			return false;
+		}
+		data += count;
+		size -= count;
+	}
+	return true;
+}
+
+/*
+ * bench_put() - PUT size bytes of contents as file_name, and wait for the
+ *               server's reply
+ */
+bool bench_put(char *server, int port, const char *file_name, const char *contents, long int size)
+{
+	int fd = connect_to_server(server, port);
+	char header[8192];
+	int header_size = snprintf(header, sizeof(header), "PUT %s\n%ld\n", file_name, size);
+	bool ok = write_all(fd, header, header_size) && write_all(fd, contents, size) && write_all(fd, "\n", 1);
+	char response[3];
+	ok = ok && read_all(fd, response, 3) && !strncmp(response, "OK ", 3);
+	close(fd);
+	return ok;
+}
+
+/*
+ * bench_get() - GET file_name and throw the contents away.  Returns the
+ *               number of bytes received, or -1 on error.
+ */
+long int bench_get(char *server, int port, const char *file_name)
+{
+	int fd = connect_to_server(server, port);
+	char request[8192];
+	int request_size = snprintf(request, sizeof(request), "GET %s\n", file_name);
+	long int file_size = -1;
+	char ok_line[8192];
+	int ok_size = 3 + strlen(file_name) + 1;
+	if(write_all(fd, request, request_size) && read_all(fd, ok_line, ok_size) && !strncmp(ok_line, "OK ", 3) &&
+		read_all(fd, (char*)&file_size, sizeof(file_size))){
+		char block[1 << 16];
+		long int remaining = file_size;
+		while(remaining > 0){
+			long int count = read(fd, block, remaining < (long int)sizeof(block) ? remaining : sizeof(block));
+			if(count <= 0){
+				file_size = -1;
+				break;
+			}
+			remaining -= count;
+		}
+	}
+	else{
+		file_size = -1;
+	}
+	close(fd);
+	return file_size;
+}
+
+/* with a ring, files are spread over the cluster instead of going to -s/-p */
+static bool clustered = false;
+static int  replicas = 1;
+
+static bool put_file(char *server, int port, const char *file_name, const char *contents, long int size)
+{
+	if(!clustered){
+		return bench_put(server, port, file_name, contents, size);
+	}
+	int owners[ring_size()];
+	int found = ring_owners(file_name, replicas, owners);
+	for(int i = 0; i < found; i++){
+		struct ring_server *owner = ring_server(owners[i]);
+		if(!bench_put(owner->host, owner->port, file_name, contents, size)){
+			return false;
+		}
+	}
+	return found > 0;
+}
+
+/* reads are spread evenly over a file's replicas */
+static long int get_file(char *server, int port, const char *file_name, unsigned int *seed)
+{
+	if(!clustered){
+		return bench_get(server, port, file_name);
+	}
+	int owners[ring_size()];
+	int found = ring_owners(file_name, replicas, owners);
+	struct ring_server *owner = ring_server(owners[rand_r(seed) % found]);
+	return bench_get(owner->host, owner->port, file_name);
+}
+
+static double percentile(vector<double>& sorted, double p){
+	if(sorted.empty()){
+		return 0;
+	}
+	size_t index = (size_t)(p * (sorted.size() - 1));
+	return sorted[index];
+}
+
+/*
+	The CPU a command's checksum and encoding stages cost per request, on
+	contents already in memory.  Nothing else a request does is timed, so a
+	command that doesn't hash costs little more than the loop itself.
+*/
+template<typename Policy>
+static double time_get_stages(vector<char>& contents, long requests){
+	char hash[2*MD5_DIGEST_LENGTH+1];
+	volatile long sink = 0;
+	double start = now_seconds();
+	for(long i = 0; i < requests; i++){
+		char* wire;
+		long int wire_size = pipeline_prepare<Policy>(contents.data(), contents.size(), hash, &wire);
+		sink = sink + wire_size + wire[i % wire_size] + hash[0];
+	}
+	return (now_seconds() - start) / requests;
+}
+
+template<typename Policy>
+static double time_put_stages(vector<char>& contents, long requests){
+	char claimed[2*MD5_DIGEST_LENGTH+1];
+	char hash[2*MD5_DIGEST_LENGTH+1];
+	md5_hex(contents.data(), contents.size(), claimed);
+	long failed = 0;
+	double start = now_seconds();
+	for(long i = 0; i < requests; i++){
+		char* file_contents;
+		long int file_size;
+		if(!pipeline_accept<Policy>(contents.data(), contents.size(), claimed, hash, &file_contents, &file_size)){
+			failed++;
+		}
+	}
+	double elapsed = now_seconds() - start;
+	if(failed){
+		die("Pipeline rejected its own digest", "");
+	}
+	return elapsed / requests;
+}
+
+static void bench_pipeline(long size, long requests){
+	vector<char> contents(size > 0 ? size : 1, 'x');
+	double get = time_get_stages<get_transfer>(contents, requests);
+	double getc = time_get_stages<getc_transfer>(contents, requests);
+	double put = time_put_stages<put_transfer>(contents, requests);
+	double putc = time_put_stages<putc_transfer>(contents, requests);
+	printf("hashing and encoding CPU per request for %ld byte files in memory, %ld requests each\n",
+		(long)contents.size(), requests);
+	printf("(no socket, disk, cache or lock work is included, so these are not request latencies):\n");
+	printf("  GET   %10.1f ns\n", get * 1e9);
+	printf("  GETC  %10.1f ns\n", getc * 1e9);
+	printf("  PUT   %10.1f ns\n", put * 1e9);
+	printf("  PUTC  %10.1f ns\n", putc * 1e9);
+}
+
+/*
+ * main() - upload the working set, then run small GETs alongside large GETs
+ *          and report small-file latency percentiles
+ */
+int main(int argc, char **argv)
+{
+	long  opt;
+	char *server = NULL;
+	int   port = 9000;
+	int   small_files = 100;
+	long  small_size = 4096;
+	int   small_threads = 4;
+	long  large_size = 0;
+	int   large_threads = 1;
+	int   duration = 10;
+	char *ring_file = NULL;
+	long  pipeline_requests = 0;
+
+	check_team(argv[0]);
+
+	while((opt = getopt(argc, argv, "hs:p:n:k:t:L:l:d:R:N:M:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'h': help(argv[0]); exit(0);
+			case 's': server = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'n': small_files = atoi(optarg); break;
+			case 'k': small_size = atol(optarg); break;
+			case 't': small_threads = atoi(optarg); break;
+			case 'L': large_size = atol(optarg); break;
+			case 'l': large_threads = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'R': ring_file = optarg; break;
+			case 'N': replicas = atoi(optarg); break;
+			case 'M': pipeline_requests = atol(optarg); break;
+		}
+	}
+	if(pipeline_requests > 0){
+		bench_pipeline(small_size, pipeline_requests);
+		exit(0);
+	}
+	if(ring_file){
+		if(!ring_load(ring_file)){
+			exit(1);
+		}
+		clustered = true;
+	}
+	else if(!server){
+		help(argv[0]);
+		exit(0);
+	}
+
+	/* upload the working set */
+	vector<char> contents(small_size > large_size ? small_size : large_size, 'x');
+	char file_name[64];
+	for(int i = 0; i < small_files; i++){
+		sprintf(file_name, "bench_small_%d", i);
+		if(!put_file(server, port, file_name, contents.data(), small_size)){
+			die("Error uploading ", file_name);
+		}
+	}
+	if(large_size > 0 && !put_file(server, port, "bench_large", contents.data(), large_size)){
+		die("Error uploading ", "bench_large");
+	}
+	vector<char>().swap(contents);
+
+	atomic<bool> running(true);
+	atomic<long> large_bytes(0);
+	atomic<long> errors(0);
+	mutex latency_mtx;
+	vector<double> latencies;
+
+	vector<thread> threads;
+	for(int t = 0; t < small_threads; t++){
+		threads.emplace_back([&, t]{
+			vector<double> mine;
+			unsigned int seed = t;
+			char name[64];
+			while(running){
+				sprintf(name, "bench_small_%d", rand_r(&seed) % small_files);
+				double start = now_seconds();
+				if(get_file(server, port, name, &seed) != small_size){
+					errors++;
+					continue;
+				}
+				mine.push_back(now_seconds() - start);
+			}
+			latency_mtx.lock();
+			latencies.insert(latencies.end(), mine.begin(), mine.end());
+			latency_mtx.unlock();
+		});
+	}
+	for(int t = 0; large_size > 0 && t < large_threads; t++){
+		threads.emplace_back([&, t]{
+			unsigned int seed = small_threads + t;
+			while(running){
+				long int received = get_file(server, port, "bench_large", &seed);
+				if(received < 0){
+					errors++;
+					continue;
+				}
+				large_bytes += received;
+			}
+		});
+	}
+
+	sleep(duration);
+	running = false;
+	for(thread& t : threads){
+		t.join();
+	}
+
+	sort(latencies.begin(), latencies.end());
+	printf("small GETs: %zu (%.0f/s), errors %ld\n", latencies.size(), latencies.size() / (double)duration, errors.load());
+	printf("small GET latency: p50 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  max %.3f ms\n",
+		percentile(latencies, 0.50) * 1000, percentile(latencies, 0.99) * 1000,
+		percentile(latencies, 0.999) * 1000, percentile(latencies, 1.0) * 1000);
+	if(large_size > 0){
+		printf("large GETs: %.1f MB/s\n", large_bytes.load() / (double)duration / (1 << 20));
+	}
+	exit(0);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+ * help() - Print a help message
+ */
+void help(char *progname);
+
+/*
+ * die() - print an error and exit the program
+ */
+void die(const char *msg1, const char *msg2);
+
+/*
+ * connect_to_server() - open a connection to the server specified by the
+ *                       parameters
+ */
+int connect_to_server(char *server, int port);
+
+/*
+ * bench_put() - PUT size bytes of contents as file_name, and wait for the
+ *               server's reply
+ */
+bool bench_put(char *server, int port, const char *file_name, const char *contents, long int size);
+
+/*
+ * bench_get() - GET file_name and throw the contents away.  Returns the
+ *               number of bytes received, or -1 on error.
+ */
+long int bench_get(char *server, int port, const char *file_name);
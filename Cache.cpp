@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include "Cache.h"
+#include "LargeIO.h"
+#include "Memory.h"
+#include "Pack.h"
+#include "Trace.h"
+#include "Server.h"
+using namespace std;
+
+mutex cache_mtx;
+
+static struct cache_entry *entries = NULL;
+static int capacity = 0;
+static unsigned long clock_tick = 0;
+static unsigned long fill_count = 0;
+
+/* Layout of the shared-memory segment handed over on a hot restart */
+#define HANDOVER_MAGIC "FSCACHE1"
+
+struct handover_header
+{
+	char     magic[8];
+	int64_t  count;
+};
+
+struct handover_entry
+{
+	int64_t  name_size;
+	int64_t  file_size;
+	char     hash[2*MD5_DIGEST_LENGTH];
+};
+
+static double started;
+static atomic<long> lookups(0);
+static atomic<long> hits(0);
+static atomic<long> warm_hits(0);
+
+static atomic<long> warm_total(0);
+static atomic<long> warm_loaded(0);
+static atomic<long> warm_next(0);
+static atomic<int>  warm_readers(0);
+static atomic<double> warm_finished(0);
+static vector<string> warm_names;
+
+/* one snapshot at a time, whether periodic or at shutdown, so an older list never lands last */
+static mutex snapshot_mtx;
+
+/*
+	Names recently found missing, with the time each entry expires.  It has
+	its own lock, so polling for absent files never contends with cache_mtx.
+*/
+static mutex missing_mtx;
+static unordered_map<string, double> missing;
+static size_t missing_capacity = 0;
+static double missing_ttl = 0;
+static unsigned long missing_generation = 0;
+static atomic<long> missing_hits(0);
+
+static double now_seconds(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* prefetched entries that were asked for, and that were evicted or replaced first */
+static atomic<long> prefetch_loaded(0);
+static atomic<long> prefetch_hits(0);
+static atomic<long> prefetch_wasted(0);
+
+static struct cache_entry *find(const char *file_name){
+	for(int i = 0; i < capacity; i++){
+		if(entries[i].file_name && !strcmp(entries[i].file_name, file_name)){
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+/* an empty slot if there is one, otherwise the least recently used entry */
+static struct cache_entry *victim(){
+	struct cache_entry *oldest = &entries[0];
+	for(int i = 0; i < capacity; i++){
+		if(!entries[i].file_name){
+			return &entries[i];
+		}
+		if(entries[i].last_used < oldest->last_used){
+			oldest = &entries[i];
+		}
+	}
+	return oldest;
+}
+
+static void fill_entry(struct cache_entry *entry, const char *file_name, long int file_size, const char *hash, char *contents){
+	if(entry->prefetched){
+		prefetch_wasted++;
+		entry->prefetched = false;
+	}
+	if(!entry->file_name || strcmp(entry->file_name, file_name)){
+		free(entry->file_name);
+		entry->file_name = strdup(file_name);
+	}
+	slab_free(entry->contents);
+	entry->contents = contents;
+	entry->file_size = file_size;
+	memcpy(entry->hash, hash, 2*MD5_DIGEST_LENGTH);
+	entry->hash[2*MD5_DIGEST_LENGTH] = '\0';
+	entry->filled = ++fill_count;
+}
+
+/*
+	Read a small file whole, from its segment if it is packed.  Returns the
+	contents in a slab_alloc() buffer, or NULL if it is missing, too large
+	for the cache, or there was no memory for it.
+*/
+static char *read_whole(const char *file_name, long int *file_size, char *hashed_file){
+	char* file_buffer = pack_read(file_name, file_size, hashed_file);
+	if(file_buffer){
+		return file_buffer;
+	}
+	FILE* whole_file = fopen(file_name, "rb");
+	if(!whole_file){
+		return NULL;
+	}
+	*file_size = read_file_size(whole_file);
+	if(large_io_wanted(*file_size)){
+		fclose(whole_file);
+		return NULL;
+	}
+	file_buffer = slab_alloc(*file_size+1);
+	if(!file_buffer){
+		fclose(whole_file);
+		return NULL;
+	}
+	if(fread(file_buffer, 1, *file_size, whole_file) != (size_t)*file_size){
+		slab_free(file_buffer);
+		fclose(whole_file);
+		return NULL;
+	}
+	fclose(whole_file);
+	file_buffer[*file_size] = '\0';
+	strcpy(hashed_file, hash_MD5(file_buffer, *file_size));
+	return file_buffer;
+}
+
+void cache_init(int lru_size){
+	capacity = lru_size > 0 ? lru_size : 0;
+	if(capacity){
+		entries = (struct cache_entry*)calloc(capacity, sizeof(struct cache_entry));
+	}
+	started = now_seconds();
+}
+
+struct cache_entry *cache_lookup(const char *file_name){
+	lookups++;
+	struct cache_entry *entry = find(file_name);
+	if(entry){
+		hits++;
+		if(!entry->last_used){
+			warm_hits++;
+		}
+		if(entry->prefetched){
+			prefetch_hits++;
+			entry->prefetched = false;
+		}
+		entry->last_used = ++clock_tick;
+	}
+	return entry;
+}
+
+void cache_insert(const char *file_name, long int file_size, const char *hash, char *contents){
+	if(!capacity){
+		slab_free(contents);
+		return;
+	}
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	struct cache_entry *entry = find(file_name);
+	if(!entry){
+		entry = victim();
+	}
+	fill_entry(entry, file_name, file_size, hash, contents);
+	entry->last_used = ++clock_tick;
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+}
+
+void cache_note_digest(const char *file_name, unsigned long filled, const char *hash){
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	struct cache_entry *entry = capacity ? find(file_name) : NULL;
+	if(entry && entry->filled == filled && !entry->hash[0]){
+		strcpy(entry->hash, hash);
+	}
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+}
+
+void cache_remove(const char *file_name){
+	if(!capacity){
+		return;
+	}
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	struct cache_entry *entry = find(file_name);
+	if(entry){
+		if(entry->prefetched){
+			prefetch_wasted++;
+		}
+		free(entry->file_name);
+		slab_free(entry->contents);
+		memset(entry, 0, sizeof(*entry));
+	}
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+}
+
+bool cache_prefetch(const char *file_name){
+	if(!capacity){
+		return false;
+	}
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	bool cached = find(file_name) != NULL;
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	if(cached || cache_missing(file_name)){
+		return false;
+	}
+	unsigned long generation = cache_missing_generation();
+	long int file_size;
+	char hashed_file[2*MD5_DIGEST_LENGTH+1];
+	char* file_buffer = read_whole(file_name, &file_size, hashed_file);
+	if(!file_buffer){
+		return false;
+	}
+
+	/* a request may have loaded it meanwhile, and a PUT may have made our copy stale */
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	struct cache_entry *entry = NULL;
+	if(!find(file_name) && generation == cache_missing_generation()){
+		entry = victim();
+		fill_entry(entry, file_name, file_size, hashed_file, file_buffer);
+		entry->last_used = ++clock_tick;
+		entry->prefetched = true;
+		prefetch_loaded++;
+	}
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	if(!entry){
+		slab_free(file_buffer);
+	}
+	return entry != NULL;
+}
+
+bool cache_save_snapshot(const char *path){
+	lock_guard<mutex> saving(snapshot_mtx);
+	vector<pair<unsigned long, string> > order;
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	for(int i = 0; i < capacity; i++){
+		if(entries[i].file_name){
+			order.push_back(make_pair(entries[i].last_used, string(entries[i].file_name)));
+		}
+	}
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	sort(order.rbegin(), order.rend());
+
+	/*
+		write a temporary file and rename it, so a crash never leaves half a
+		snapshot; the pid keeps it apart from a hot restart's other server
+	*/
+	string temp_path = string(path) + ".tmp." + to_string(getpid());
+	FILE* snapshot = fopen(temp_path.c_str(), "w");
+	if(!snapshot){
+		perror("Error writing cache snapshot");
+		return false;
+	}
+	for(size_t i = 0; i < order.size(); i++){
+		fprintf(snapshot, "%s\n", order[i].second.c_str());
+	}
+	if(fclose(snapshot) != 0 || rename(temp_path.c_str(), path) < 0){
+		perror("Error writing cache snapshot");
+		return false;
+	}
+	return true;
+}
+
+static void warm_reader(){
+	while(1){
+		long next = warm_next++;
+		if(next >= (long)warm_names.size()){
+			break;
+		}
+		const char* file_name = warm_names[next].c_str();
+		long int file_size;
+		char hashed_file[2*MD5_DIGEST_LENGTH+1];
+		char* file_buffer = read_whole(file_name, &file_size, hashed_file);
+		if(!file_buffer){
+			continue;
+		}
+
+		/* live traffic may have beaten us to it, or filled the cache already */
+		trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+		struct cache_entry *entry = NULL;
+		if(!find(file_name)){
+			entry = victim();
+			if(entry->file_name){
+				entry = NULL;
+			}
+		}
+		if(entry){
+			fill_entry(entry, file_name, file_size, hashed_file, file_buffer);
+			entry->last_used = 0;
+			warm_loaded++;
+		}
+		trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+		if(!entry){
+			slab_free(file_buffer);
+		}
+		arena_reset();
+	}
+	if(--warm_readers == 0){
+		warm_finished = now_seconds();
+		cache_print_stats(stderr);
+	}
+}
+
+void cache_warm_start(const char *path, int readers){
+	if(!capacity){
+		return;
+	}
+	FILE* snapshot = fopen(path, "r");
+	if(!snapshot){
+		return;
+	}
+	char line[8192];
+	while(fgets(line, sizeof(line), snapshot) && (int)warm_names.size() < capacity){
+		line[strcspn(line, "\n")] = '\0';
+		if(line[0]){
+			warm_names.push_back(line);
+		}
+	}
+	fclose(snapshot);
+	warm_total = warm_names.size();
+	if(warm_names.empty()){
+		return;
+	}
+	if(readers < 1){
+		readers = 1;
+	}
+	warm_readers = readers;
+	for(int i = 0; i < readers; i++){
+		thread(warm_reader).detach();
+	}
+}
+
+int cache_export(){
+	if(!capacity){
+		return -1;
+	}
+	int fd = memfd_create("file-server-cache", MFD_CLOEXEC);
+	if(fd < 0){
+		perror("Error creating cache handover segment");
+		return -1;
+	}
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	vector<pair<unsigned long, int> > order;
+	size_t total = sizeof(struct handover_header);
+	for(int i = 0; i < capacity; i++){
+		if(entries[i].file_name){
+			total += sizeof(struct handover_entry) + strlen(entries[i].file_name) + entries[i].file_size;
+			order.push_back(make_pair(entries[i].last_used, i));
+		}
+	}
+	sort(order.rbegin(), order.rend());
+	char* segment = NULL;
+	if(ftruncate(fd, total) == 0){
+		segment = (char*)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if(!segment || segment == MAP_FAILED){
+		trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+		perror("Error mapping cache handover segment");
+		close(fd);
+		return -1;
+	}
+	struct handover_header *header = (struct handover_header*)segment;
+	memcpy(header->magic, HANDOVER_MAGIC, sizeof(header->magic));
+	header->count = order.size();
+	char* position = segment + sizeof(*header);
+	for(size_t i = 0; i < order.size(); i++){
+		struct cache_entry *entry = &entries[order[i].second];
+		struct handover_entry handed;
+		handed.name_size = strlen(entry->file_name);
+		handed.file_size = entry->file_size;
+		memcpy(handed.hash, entry->hash, sizeof(handed.hash));
+		memcpy(position, &handed, sizeof(handed));
+		position += sizeof(handed);
+		memcpy(position, entry->file_name, handed.name_size);
+		position += handed.name_size;
+		memcpy(position, entry->contents, handed.file_size);
+		position += handed.file_size;
+	}
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	munmap(segment, total);
+	return fd;
+}
+
+void cache_import(int fd){
+	struct stat info;
+	if(fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(struct handover_header) || !capacity){
+		close(fd);
+		return;
+	}
+	char* segment = (char*)mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(segment == MAP_FAILED){
+		perror("Error mapping cache handover segment");
+		return;
+	}
+	char* end = segment + info.st_size;
+	struct handover_header *header = (struct handover_header*)segment;
+	char* position = segment + sizeof(*header);
+	long imported = 0;
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	for(int64_t i = 0; !memcmp(header->magic, HANDOVER_MAGIC, sizeof(header->magic)) && i < header->count; i++){
+		struct handover_entry handed;
+		if(position + sizeof(handed) > end){
+			break;
+		}
+		memcpy(&handed, position, sizeof(handed));
+		position += sizeof(handed);
+		if(handed.name_size < 0 || handed.file_size < 0 || position + handed.name_size + handed.file_size > end){
+			break;
+		}
+		string file_name(position, handed.name_size);
+		position += handed.name_size;
+		char* contents = slab_alloc(handed.file_size + 1);
+		if(!contents){
+			/* whatever doesn't fit now is read back from disk on its first miss */
+			break;
+		}
+		memcpy(contents, position, handed.file_size);
+		contents[handed.file_size] = '\0';
+		position += handed.file_size;
+
+		/* anything this process cached itself is newer than the handed-over copy */
+		struct cache_entry *entry = NULL;
+		if(!find(file_name.c_str())){
+			entry = victim();
+			if(entry->file_name){
+				entry = NULL;
+			}
+		}
+		if(!entry){
+			slab_free(contents);
+			continue;
+		}
+		fill_entry(entry, file_name.c_str(), handed.file_size, handed.hash, contents);
+		entry->last_used = 0;
+		imported++;
+	}
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	munmap(segment, info.st_size);
+	fprintf(stderr, "cache: %ld entries handed over from the previous process\n", imported);
+}
+
+void cache_missing_init(int max_names, int ttl_ms){
+	missing_capacity = max_names > 0 ? max_names : 0;
+	missing_ttl = ttl_ms > 0 ? ttl_ms / 1000.0 : 0;
+	missing.reserve(missing_capacity);
+}
+
+unsigned long cache_missing_generation(){
+	lock_guard<mutex> lock(missing_mtx);
+	return missing_generation;
+}
+
+bool cache_missing(const char *file_name){
+	if(!missing_capacity || !missing_ttl){
+		return false;
+	}
+	lock_guard<mutex> lock(missing_mtx);
+	auto it = missing.find(file_name);
+	if(it == missing.end()){
+		return false;
+	}
+	if(it->second < now_seconds()){
+		missing.erase(it);
+		return false;
+	}
+	missing_hits++;
+	return true;
+}
+
+void cache_note_missing(const char *file_name, unsigned long generation){
+	if(!missing_capacity || !missing_ttl){
+		return;
+	}
+	double now = now_seconds();
+	lock_guard<mutex> lock(missing_mtx);
+	/* a PUT may have created the file since the caller looked */
+	if(generation != missing_generation){
+		return;
+	}
+	if(missing.size() >= missing_capacity && !missing.count(file_name)){
+		for(auto it = missing.begin(); it != missing.end(); ){
+			it = it->second < now ? missing.erase(it) : next(it);
+		}
+		if(missing.size() >= missing_capacity){
+			missing.erase(missing.begin());
+		}
+	}
+	missing[file_name] = now + missing_ttl;
+}
+
+void cache_forget_missing(const char *file_name){
+	lock_guard<mutex> lock(missing_mtx);
+	missing_generation++;
+	missing.erase(file_name);
+}
+
+void cache_print_stats(FILE *out){
+	long looked = lookups.load();
+	long hit = hits.load();
+	fprintf(out, "cache: %ld lookups, hit ratio %.1f%% since startup (%ld warm-loaded entries hit)\n",
+		looked, looked ? 100.0 * hit / looked : 0.0, warm_hits.load());
+	if(prefetch_loaded.load()){
+		long loaded = prefetch_loaded.load();
+		fprintf(out, "cache: %ld files prefetched, %ld hit (%.1f%%), %ld evicted or replaced unused\n",
+			loaded, prefetch_hits.load(), 100.0 * prefetch_hits.load() / loaded, prefetch_wasted.load());
+	}
+	if(missing_capacity && missing_ttl){
+		missing_mtx.lock();
+		size_t missing_names = missing.size();
+		missing_mtx.unlock();
+		fprintf(out, "cache: %ld lookups of missing files answered from memory (%zu names held)\n",
+			missing_hits.load(), missing_names);
+	}
+	if(warm_total.load()){
+		double finished = warm_finished.load();
+		if(finished){
+			fprintf(out, "cache: warm-up loaded %ld of %ld snapshot files in %.3f s\n",
+				warm_loaded.load(), warm_total.load(), finished - started);
+		}
+		else{
+			fprintf(out, "cache: warm-up in progress, %ld of %ld snapshot files loaded after %.3f s\n",
+				warm_loaded.load(), warm_total.load(), now_seconds() - started);
+		}
+	}
+}
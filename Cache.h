@@ -0,0 +1,129 @@
+#pragma once
+
+#include <openssl/md5.h>
+#include <stdio.h>
+#include <mutex>
+
+/*
+ * One file held in the LRU cache.  The cache owns file_name and contents.
+ */
+struct cache_entry
+{
+	char          *file_name;
+	char          *contents;
+	long int       file_size;
+	char           hash[2*MD5_DIGEST_LENGTH+1];  /* empty until something needs it */
+	unsigned long  last_used;
+	bool           prefetched;  /* loaded ahead of a request that hasn't come yet */
+	unsigned long  filled;      /* changes whenever the contents are replaced */
+};
+
+/*
+ * cache_mtx protects every entry.  Hold it for as long as an entry returned
+ * by cache_lookup() is being used.
+ */
+extern std::mutex cache_mtx;
+
+/*
+ * cache_init() - size the cache.  An lru_size of 0 disables it.
+ */
+void cache_init(int lru_size);
+
+/*
+ * cache_lookup() - find file_name and mark it most recently used.  The
+ *                  caller must hold cache_mtx.  Returns NULL on a miss.
+ */
+struct cache_entry *cache_lookup(const char *file_name);
+
+/*
+ * cache_insert() - store contents under file_name, replacing any older copy
+ *                  or else evicting the least recently used entry.  The cache
+ *                  takes ownership of contents, and frees it if disabled.
+ *                  hash may be empty if the digest hasn't been worked out.
+ */
+void cache_insert(const char *file_name, long int file_size, const char *hash, char *contents);
+
+/*
+ * cache_note_digest() - keep the digest worked out for file_name's cached
+ *                       contents, unless they have been replaced since the
+ *                       entry's filled was read
+ */
+void cache_note_digest(const char *file_name, unsigned long filled, const char *hash);
+
+/*
+ * cache_remove() - drop any copy of file_name, which has just been replaced
+ *                  by a file too large to cache
+ */
+void cache_remove(const char *file_name);
+
+/*
+ * cache_prefetch() - read file_name into the cache ahead of a request for
+ *                    it, evicting the least recently used entry if need be.
+ *                    Returns false if it was cached already, is missing or
+ *                    too large for the cache, or a PUT came through while it
+ *                    was being read.
+ */
+bool cache_prefetch(const char *file_name);
+
+/*
+ * cache_save_snapshot() - write the cached file names to path, most recently
+ *                         used first
+ */
+bool cache_save_snapshot(const char *path);
+
+/*
+ * cache_warm_start() - read the snapshot at path, and load the files it
+ *                      names in the background with readers threads, most
+ *                      recently used first.  Warm loads only fill free slots,
+ *                      so they never evict what live traffic brought in.
+ */
+void cache_warm_start(const char *path, int readers);
+
+/*
+ * cache_export() - copy every entry, most recently used first, into a new
+ *                  memory fd for a process taking over from this one.
+ *                  Returns the fd, or -1.
+ */
+int cache_export();
+
+/*
+ * cache_import() - load the entries written by cache_export() in another
+ *                  process.  Like warm loads they only fill free slots, and
+ *                  never replace a file this process has cached itself.
+ *                  Closes fd.
+ */
+void cache_import(int fd);
+
+/*
+ * cache_missing_init() - remember up to max_names files found missing, for
+ *                        ttl_ms each.  Either being 0 disables it.
+ */
+void cache_missing_init(int max_names, int ttl_ms);
+
+/*
+ * cache_missing_generation() - read before looking for a file, and pass to
+ *                              cache_note_missing() if it wasn't there
+ */
+unsigned long cache_missing_generation();
+
+/*
+ * cache_missing() - true if file_name was recently found missing, so the
+ *                   filesystem needn't be asked again
+ */
+bool cache_missing(const char *file_name);
+
+/*
+ * cache_note_missing() - remember that file_name doesn't exist, unless a
+ *                        PUT has come through since generation was read
+ */
+void cache_note_missing(const char *file_name, unsigned long generation);
+
+/*
+ * cache_forget_missing() - file_name has just been created
+ */
+void cache_forget_missing(const char *file_name);
+
+/*
+ * cache_print_stats() - dump hit ratios, prefetch waste and warm-up progress
+ */
+void cache_print_stats(FILE *out);
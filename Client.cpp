@@ -18,9 +18,11 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "support.h"
 #include "Client.h"
+#include "Ring.h"
 
 void help(char *progname)
 {
@@ -31,6 +33,10 @@ void help(char *progname)
 	printf("  -s    server info (IP or hostname)\n");
 	printf("  -p    port on which to contact server\n");
 	printf("  -S    for GETs, name to use when saving file locally\n");
+	printf("  -L    list files on the server whose names start with parameter\n");
+	printf("  -I    print size, modification time and MD5 of file indicated by parameter\n");
+	printf("  -R    ring file listing the cluster's servers, instead of -s and -p\n");
+	printf("  -n    with -R, servers each PUT is replicated to (default 1)\n");
 }
 
 void die(const char *msg1, const char *msg2)
@@ -75,14 +81,14 @@ int connect_to_server(char *server, int port)
 	return clientfd;
 }
 
-char* hash_MD5(char* file_contents){
+char* hash_MD5(char* file_contents, long int file_size){
 	unsigned char digest[MD5_DIGEST_LENGTH];
 	MD5_CTX mdContext;
 	MD5_Init(&mdContext);
-	MD5_Update(&mdContext, file_contents, strlen(file_contents));
+	MD5_Update(&mdContext, file_contents, file_size);
 	MD5_Final (digest ,&mdContext);
 
-	char* hashed_string = (char *)malloc(2*MD5_DIGEST_LENGTH*sizeof(char));
+	char* hashed_string = (char *)malloc((2*MD5_DIGEST_LENGTH+1)*sizeof(char));
 	bzero(hashed_string, MD5_DIGEST_LENGTH);
 	for(int i = 0; i < MD5_DIGEST_LENGTH; i++){
 		sprintf(&hashed_string[i*2], "%02x", digest[i]);
@@ -90,47 +96,111 @@ char* hash_MD5(char* file_contents){
 	return hashed_string;
 }
 
-void send_GET(int fd, char* file_name){
-	const unsigned int request_size = 4 + strlen(file_name)+1;
-	char get_request[request_size];
-	bzero(get_request, request_size);
+/*
+	With a digest of the copy we already have, the GET becomes conditional
+	and the server may answer NOTMODIFIED instead of sending the file
+*/
+void send_GET(int fd, char* file_name, char* digest){
+	const unsigned int request_size = 4 + strlen(file_name)+1 + (digest ? 10+32+1 : 0);
+	char get_request[request_size+1];
+	bzero(get_request, request_size+1);
 	sprintf(get_request, "GET %s\n", file_name);
+	if(digest){
+		sprintf(get_request + strlen(get_request), "IF-DIGEST %s\n", digest);
+	}
 	write(fd, get_request, request_size);
 }
 
-void send_GETC(int fd, char* file_name){
-	const unsigned int request_size = 5 + strlen(file_name) +1;
-	char get_request[request_size];
-	bzero(get_request, request_size);
+void send_GETC(int fd, char* file_name, char* digest){
+	const unsigned int request_size = 5 + strlen(file_name) +1 + (digest ? 10+32+1 : 0);
+	char get_request[request_size+1];
+	bzero(get_request, request_size+1);
 	sprintf(get_request, "GETC %s\n", file_name);
+	if(digest){
+		sprintf(get_request + strlen(get_request), "IF-DIGEST %s\n", digest);
+	}
 	printf("%s\n", get_request);
 	write(fd, get_request, request_size);
 }
 
+/*
+	Large files don't fit in one write(), so keep going until the whole
+	buffer is out
+*/
+bool write_all(int fd, const char* data, long int size){
+	while(size > 0){
+		long int count = write(fd, data, size);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			return false;
+		}
+		data += count;
+		size -= count;
+	}
+	return true;
+}
+
 void send_PUT(int fd, char* put_name, char* put_buffer, long int file_size){
-	const long int request_size = 4+strlen(put_name)+1+sizeof(file_size)+1+file_size+1;
-	char request_buffer[request_size];
-	bzero(request_buffer, request_size);
-	sprintf(request_buffer, "PUT %s\n%ld\n%s\n", put_name, file_size, put_buffer);
-	if(write(fd, request_buffer, request_size) < 0){
+	const long int header_size = 4+strlen(put_name)+1+21+1;
+	char request_buffer[header_size];
+	bzero(request_buffer, header_size);
+	sprintf(request_buffer, "PUT %s\n%ld\n", put_name, file_size);
+	if(!write_all(fd, request_buffer, strlen(request_buffer)) || !write_all(fd, put_buffer, file_size) || !write_all(fd, "\n", 1)){
 		perror("Error writing file to server");
 	}
 }
 
 void send_PUTC(int fd, char* put_name, char* put_buffer, long int file_size){
-	const long int request_size = 5+strlen(put_name)+1+sizeof(file_size)+33+file_size+1;
-	char* request_buffer = (char*)malloc(sizeof(char)*request_size);
-	sprintf(request_buffer, "PUTC %s\n%ld\n%s\n%s\n", put_name, file_size, hash_MD5(put_buffer), put_buffer);
-	if(write(fd, request_buffer, request_size) < 0){
+	const long int header_size = 5+strlen(put_name)+1+21+1+33;
+	char request_buffer[header_size];
+	bzero(request_buffer, header_size);
+	char* hash = hash_MD5(put_buffer, file_size);
+	sprintf(request_buffer, "PUTC %s\n%ld\n%s\n", put_name, file_size, hash);
+	free(hash);
+	if(!write_all(fd, request_buffer, strlen(request_buffer)) || !write_all(fd, put_buffer, file_size) || !write_all(fd, "\n", 1)){
 		perror("Error writing file to server");
 	}
 }
 
+/*
+	Read the reply line one byte at a time, so that nothing after the newline
+	is consumed
+*/
+long int read_response_line(int fd, char* response, long int size){
+	bzero(response, size);
+	long int received = 0;
+	while(received < size - 1){
+		long int count = read(fd, response + received, 1);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			break;
+		}
+		received += count;
+		if(response[received - 1] == '\n'){
+			break;
+		}
+	}
+	return received;
+}
+
+/*
+	A GET is answered with "OK <filename>", "NOTMODIFIED <filename>" if the
+	conditional GET matched, or a one-line error.  Only OK is followed by a
+	file.
+*/
 bool read_OK(int fd, char* file_name){
-	char OK_response[3+strlen(file_name)+1];
-	bzero(OK_response, 3+strlen(file_name)+1);
-	if(read(fd, OK_response, 3+strlen(file_name)+1) < 0){
-		perror("Inavlid OK - response from server");
+	char OK_response[8192];
+	long int received = read_response_line(fd, OK_response, sizeof(OK_response));
+	if(!strncmp(OK_response, "NOTMODIFIED ", 12)){
+		printf("%s not modified\n", file_name);
+		return false;
+	}
+	if(strncmp(OK_response, "OK ", 3)){
+		fprintf(stderr, "%s", received ? OK_response : "Inavlid OK - response from server\n");
 		return false;
 	}
 	return true;
@@ -158,11 +228,21 @@ char* read_hash(int fd){
 
 
 char* receive_file(int fd, long int file_size){
-	char* file_buffer = (char *)malloc(sizeof(char)*(file_size));
-	if(read(fd, file_buffer, file_size) < 0){
-		perror("Error receiving checksum from server");
-		free(file_buffer);
+	char* file_buffer = (char *)malloc(sizeof(char)*(file_size+1));
+	long int received = 0;
+	while(received < file_size){
+		long int count = read(fd, file_buffer + received, file_size - received);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			perror("Error receiving file from server");
+			free(file_buffer);
+			return NULL;
+		}
+		received += count;
 	}
+	file_buffer[file_size] = '\0';
 	return file_buffer;
 }
 
@@ -200,19 +280,32 @@ void get_file(int fd, char *get_name, char *save_name, bool checksum)
 		save_name = get_name;
 	}
 
+	/* if we already have a copy, only ask for the file if it changed */
+	char* local_digest = NULL;
+	if(FILE* local_file = fopen(save_name, "rb")){
+		long int local_size = read_file_size(local_file);
+		char* local_buffer = (char*)malloc(sizeof(char)*(local_size+1));
+		if(fread(local_buffer, 1, local_size, local_file) == (size_t)local_size){
+			local_digest = hash_MD5(local_buffer, local_size);
+		}
+		free(local_buffer);
+		fclose(local_file);
+	}
+
 	if(checksum){
-		send_GETC(fd, get_name);
+		send_GETC(fd, get_name, local_digest);
 	}
 	else{
-		send_GET(fd, get_name);
+		send_GET(fd, get_name, local_digest);
 	}
+	free(local_digest);
 
 	if(read_OK(fd, get_name)){
 		if(long int file_size = read_file_size(fd)){
 			if(checksum){
 				if(char* received_hash = read_hash(fd)){
 					if(char* file_buffer = receive_file(fd, file_size)){
-						if(char* calculated_hash = hash_MD5(file_buffer)){
+						if(char* calculated_hash = hash_MD5(file_buffer, file_size)){
 							if(compare_hashes(received_hash, calculated_hash)){
 								write_to_disk(save_name, file_buffer, file_size);
 							}
@@ -236,10 +329,47 @@ void get_file(int fd, char *get_name, char *save_name, bool checksum)
 	}
 }
 
+/*
+	The server replies "OK <filename>" once the file is stored (and durable,
+	if it was asked to be), or with a one-line error
+*/
+bool read_put_response(int fd){
+	char response[8192];
+	long int received = read_response_line(fd, response, sizeof(response));
+	if(strncmp(response, "OK ", 3)){
+		fprintf(stderr, "%s", received ? response : "No response from server\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * query_server() - send a LIST or STAT request, and copy the reply that
+ *                  follows "OK" to stdout.  Errors go to stderr.
+ */
+void query_server(int fd, const char *command, char *argument)
+{
+	const long int request_size = strlen(command)+1+strlen(argument)+1;
+	char request[request_size+1];
+	sprintf(request, "%s %s\n", command, argument);
+	if(!write_all(fd, request, strlen(request))){
+		perror("Error sending request to server");
+		return;
+	}
+	if(!read_put_response(fd)){
+		return;
+	}
+	char buffer[8192];
+	long int count;
+	while((count = read(fd, buffer, sizeof(buffer))) > 0){
+		fwrite(buffer, count, 1, stdout);
+	}
+}
+
 /*
  * put_file() - send a file to the server accessible via the given socket fd
  */
-void put_file(int fd, char *put_name, bool checksum)
+bool put_file(int fd, char *put_name, bool checksum)
 {
 	if(!put_name){
 		perror("No put name specified");
@@ -258,12 +388,79 @@ void put_file(int fd, char *put_name, bool checksum)
 		else{
 			send_PUT(fd, put_name, put_buffer, file_size);
 		}
+		free(put_buffer);
+		return read_put_response(fd);
 	}
 	else{
 		perror("Invalid File");
+		return false;
 	}
 }
 
+/*
+ * cluster_request() - route a request by the ring: a PUT goes to every
+ *                     replica, a GET or STAT to one replica picked at random
+ *                     (trying the others if it is down), and a LIST to every
+ *                     server.  Returns false if the request failed.
+ */
+bool cluster_request(char *put_name, char *get_name, char *save_name, char *list_prefix, char *stat_name,
+	bool checksum, int replicas)
+{
+	if(list_prefix){
+		for(int i = 0; i < ring_size(); i++){
+			int fd = ring_connect(i);
+			if(fd >= 0){
+				query_server(fd, "LIST", list_prefix);
+				close(fd);
+			}
+		}
+		return true;
+	}
+
+	char *file_name = put_name ? put_name : get_name ? get_name : stat_name;
+	if(!file_name){
+		fprintf(stderr, "%s", "No file name specified\n");
+		return false;
+	}
+	int owners[ring_size()];
+	int found = ring_owners(file_name, replicas, owners);
+
+	if(put_name){
+		int stored = 0;
+		for(int i = 0; i < found; i++){
+			int fd = ring_connect(owners[i]);
+			if(fd >= 0){
+				stored += put_file(fd, put_name, checksum);
+				close(fd);
+			}
+		}
+		if(stored < found){
+			fprintf(stderr, "%s stored on %d of %d replicas\n", put_name, stored, found);
+		}
+		return stored > 0;
+	}
+
+	/* spread reads over the replicas */
+	srand(getpid() ^ time(NULL));
+	int first = rand() % found;
+	for(int i = 0; i < found; i++){
+		int fd = ring_connect(owners[(first + i) % found]);
+		if(fd < 0){
+			continue;
+		}
+		if(get_name){
+			get_file(fd, get_name, save_name, checksum);
+		}
+		else{
+			query_server(fd, "STAT", stat_name);
+		}
+		close(fd);
+		return true;
+	}
+	fprintf(stderr, "No replica of %s could be reached\n", file_name);
+	return false;
+}
+
 /*
  * main() - parse command line, open a socket, transfer a file
  */
@@ -277,11 +474,15 @@ int main(int argc, char **argv)
 	int   port;
 	char *save_name = NULL;
 	bool checksum = false;
+	char *list_prefix = NULL;
+	char *stat_name = NULL;
+	char *ring_file = NULL;
+	int   replicas = 1;
 
 	check_team(argv[0]);
 
 	/* parse the command-line options. */
-	while((opt = getopt(argc, argv, "hs:P:G:S:p:c")) != -1)
+	while((opt = getopt(argc, argv, "hs:P:G:S:p:cL:I:R:n:")) != -1)
 	{
 		switch(opt)
 		{
@@ -291,11 +492,24 @@ int main(int argc, char **argv)
 			case 'G': get_name = optarg; break;
 			case 'S': save_name = optarg; break;
 			case 'p': port = atoi(optarg); break;
-			case 'c': checksum = true;
+			case 'c': checksum = true; break;
+			case 'L': list_prefix = optarg; break;
+			case 'I': stat_name = optarg; break;
+			case 'R': ring_file = optarg; break;
+			case 'n': replicas = atoi(optarg); break;
 		}
 	}
 
 
+	/* in cluster mode each request finds its own servers */
+	if(ring_file){
+		if(!ring_load(ring_file)){
+			exit(1);
+		}
+		exit(cluster_request(put_name, get_name, save_name, list_prefix, stat_name, checksum,
+			replicas > 0 ? replicas : 1) ? 0 : 1);
+	}
+
 	/* open a connection to the server */
 	int fd = connect_to_server(server, port);
 
@@ -304,6 +518,14 @@ int main(int argc, char **argv)
 	{
 		put_file(fd, put_name, checksum);
 	}
+	else if(list_prefix)
+	{
+		query_server(fd, "LIST", list_prefix);
+	}
+	else if(stat_name)
+	{
+		query_server(fd, "STAT", stat_name);
+	}
 	else
 	{
 		get_file(fd, get_name, save_name, checksum);
@@ -26,11 +26,26 @@ void echo_client(int fd);
 /*
  * put_file() - send a file to the server accessible via the given socket fd
  */
-void put_file(int fd, char *put_name);
+bool put_file(int fd, char *put_name, bool checksum);
 
 /*
  * get_file() - get a file from the server accessible via the given socket
  *              fd, and save it according to the save_name
  */
-void get_file(int fd, char *get_name, char *save_name);
+void get_file(int fd, char *get_name, char *save_name, bool checksum);
 
+
+/*
+ * query_server() - send a LIST or STAT request, and copy the reply that
+ *                  follows "OK" to stdout.  Errors go to stderr.
+ */
+void query_server(int fd, const char *command, char *argument);
+
+/*
+ * cluster_request() - route a request by the ring: a PUT goes to every
+ *                     replica, a GET or STAT to one replica picked at random
+ *                     (trying the others if it is down), and a LIST to every
+ *                     server.  Returns false if the request failed.
+ */
+bool cluster_request(char *put_name, char *get_name, char *save_name, char *list_prefix, char *stat_name,
+	bool checksum, int replicas);
@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Durability.h"
+using namespace std;
+
+/*
+ * One PUT waiting for its data to be flushed.  Tickets live on the waiting
+ * thread's stack; the committer only touches them under commit_mtx.
+ */
+struct commit_ticket
+{
+	int    fd;
+	string directory;  /* holding the file's entry, or empty if it needs no flush */
+	bool   done;
+	int    err;
+};
+
+static enum durability_mode mode = DURABLE_NONE;
+static int window_us;
+static int max_batch;
+
+static mutex commit_mtx;
+static condition_variable work_cv;      /* committer waits for tickets */
+static condition_variable done_cv;      /* PUTs wait for their flush */
+static vector<commit_ticket*> waiting;
+
+static atomic<long> commits(0);
+static atomic<long> rounds(0);
+
+/*
+ * Flush one window.  Returns 0 or the errno of the first failure, which is
+ * reported to every PUT in the window since we can't tell whose data it was.
+ */
+static int flush_batch(vector<commit_ticket*>& batch){
+	if(mode == DURABLE_SYNCFS){
+		if(syncfs(batch[0]->fd) < 0){
+			return errno;
+		}
+		return 0;
+	}
+	int err = 0;
+	set<string> directories;
+	for(commit_ticket* ticket : batch){
+		if(fdatasync(ticket->fd) < 0 && !err){
+			err = errno;
+		}
+		if(!ticket->directory.empty()){
+			directories.insert(ticket->directory);
+		}
+	}
+	/* new files aren't durable until their directory entry is, so each directory is flushed once */
+	for(const string& directory : directories){
+		int dirfd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+		if(dirfd < 0 || fsync(dirfd) < 0){
+			if(!err){
+				err = errno;
+			}
+		}
+		if(dirfd >= 0){
+			close(dirfd);
+		}
+	}
+	return err;
+}
+
+static void committer(){
+	unique_lock<mutex> lock(commit_mtx);
+	while(1){
+		work_cv.wait(lock, []{ return !waiting.empty(); });
+
+		/* hold the window open so concurrent PUTs can join it */
+		auto deadline = chrono::steady_clock::now() + chrono::microseconds(window_us);
+		work_cv.wait_until(lock, deadline, []{ return (int)waiting.size() >= max_batch; });
+
+		vector<commit_ticket*> batch;
+		if((int)waiting.size() > max_batch){
+			batch.assign(waiting.begin(), waiting.begin() + max_batch);
+			waiting.erase(waiting.begin(), waiting.begin() + max_batch);
+		}
+		else{
+			batch.swap(waiting);
+		}
+
+		/* new PUTs queue up for the next window while this one flushes */
+		lock.unlock();
+		int err = flush_batch(batch);
+		rounds++;
+		commits += batch.size();
+		lock.lock();
+
+		for(commit_ticket* ticket : batch){
+			ticket->err = err;
+			ticket->done = true;
+		}
+		done_cv.notify_all();
+	}
+}
+
+void durability_init(enum durability_mode durable, int window, int batch){
+	mode = durable;
+	window_us = window;
+	max_batch = batch > 0 ? batch : 1;
+	if(mode != DURABLE_NONE){
+		thread(committer).detach();
+	}
+}
+
+bool durability_enabled(){
+	return mode != DURABLE_NONE;
+}
+
+int durability_commit(int fd, const char *file_name){
+	if(mode == DURABLE_NONE){
+		return 0;
+	}
+	commit_ticket ticket = { fd, "", false, 0 };
+	if(file_name){
+		const char *slash = strrchr(file_name, '/');
+		ticket.directory = slash ? string(file_name, slash - file_name + 1) : string(".");
+	}
+	unique_lock<mutex> lock(commit_mtx);
+	waiting.push_back(&ticket);
+	if((int)waiting.size() == 1 || (int)waiting.size() >= max_batch){
+		work_cv.notify_one();
+	}
+	done_cv.wait(lock, [&]{ return ticket.done; });
+	return ticket.err;
+}
+
+void durability_print_stats(FILE *out){
+	long flushed = commits.load();
+	long windows = rounds.load();
+	fprintf(out, "durability: %ld commits in %ld flush rounds (%.1f per round)\n",
+		flushed, windows, windows ? (double)flushed / windows : 0.0);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * How a commit window is flushed to stable storage.  DURABLE_NONE leaves
+ * PUTs to the page cache, as before.
+ */
+enum durability_mode
+{
+	DURABLE_NONE,
+	DURABLE_SYNCFS,     /* one syncfs() per window */
+	DURABLE_FDATASYNC   /* fdatasync() each file, then fsync() the directory once */
+};
+
+/*
+ * durability_init() - start the committer thread.  PUTs arriving within
+ *                     window_us of the first one in a window, up to
+ *                     max_batch of them, are flushed together.
+ */
+void durability_init(enum durability_mode mode, int window_us, int max_batch);
+
+/*
+ * durability_enabled() - true if PUTs must wait for durability_commit()
+ */
+bool durability_enabled();
+
+/*
+ * durability_commit() - block until everything written to fd has reached
+ *                       stable storage.  If file_name is not NULL, fd was
+ *                       opened as file_name, and the directory holding it
+ *                       is flushed too, so a newly created file survives.
+ *                       Returns 0, or the errno of the flush that failed.
+ */
+int durability_commit(int fd, const char *file_name);
+
+/*
+ * durability_print_stats() - dump the number of commits and flush rounds
+ */
+void durability_print_stats(FILE *out);
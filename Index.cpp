@@ -0,0 +1,210 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Index.h"
+#include "LargeIO.h"
+#include "Pipeline.h"
+using namespace std;
+
+/* LIST replies are built and sent in pieces of about this size, so the index lock is never held across a write */
+#define LIST_CHUNK (64 * 1024)
+
+static shared_mutex index_mtx;
+static map<string, file_meta> files;
+static atomic<bool> scanned(false);
+
+static vector<string> scan_names;
+static atomic<size_t> scan_next(0);
+static atomic<int> scan_workers(0);
+
+static bool digest_file(const char *file_name, long int file_size, char *digest){
+	int fd = open(file_name, O_RDONLY);
+	if(fd < 0){
+		return false;
+	}
+	static const long int block_size = 1 << 20;
+	char* block = (char*)malloc(block_size);
+	MD5_CTX mdContext;
+	MD5_Init(&mdContext);
+	long int count;
+	while((count = read(fd, block, block_size)) > 0){
+		MD5_Update(&mdContext, block, count);
+	}
+	free(block);
+	/* a big file hashed once at startup shouldn't stay in the page cache */
+	if(large_io_wanted(file_size)){
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	close(fd);
+	if(count < 0){
+		return false;
+	}
+	md5_final_hex(&mdContext, digest);
+	return true;
+}
+
+static bool stat_file(const char *file_name, struct file_meta *meta){
+	struct stat info;
+	if(stat(file_name, &info) < 0 || !S_ISREG(info.st_mode)){
+		return false;
+	}
+	meta->file_size = info.st_size;
+	meta->mtime = info.st_mtime;
+	meta->digest[0] = '\0';
+	return true;
+}
+
+static void scan_worker(){
+	while(1){
+		size_t next = scan_next++;
+		if(next >= scan_names.size()){
+			break;
+		}
+		const char* file_name = scan_names[next].c_str();
+		struct file_meta meta;
+		if(!stat_file(file_name, &meta) || !digest_file(file_name, meta.file_size, meta.digest)){
+			continue;
+		}
+		/* a PUT that landed while we were hashing has the newer view */
+		index_mtx.lock();
+		files.emplace(scan_names[next], meta);
+		index_mtx.unlock();
+	}
+	if(--scan_workers == 0){
+		scanned = true;
+		vector<string>().swap(scan_names);
+		index_mtx.lock_shared();
+		fprintf(stderr, "index: %zu files indexed\n", files.size());
+		index_mtx.unlock_shared();
+	}
+}
+
+static void scan(int threads){
+	DIR* directory = opendir(".");
+	if(!directory){
+		perror("Error scanning directory for index");
+		scanned = true;
+		return;
+	}
+	struct dirent* dirent;
+	while((dirent = readdir(directory))){
+		/* the server's own bookkeeping files start with a dot */
+		if(dirent->d_name[0] == '.'){
+			continue;
+		}
+		if(dirent->d_type == DT_REG || dirent->d_type == DT_UNKNOWN){
+			scan_names.push_back(dirent->d_name);
+		}
+	}
+	closedir(directory);
+	if(scan_names.empty()){
+		scanned = true;
+		return;
+	}
+	scan_workers = threads;
+	for(int i = 0; i < threads; i++){
+		thread(scan_worker).detach();
+	}
+}
+
+void index_build(int threads){
+	thread(scan, threads > 0 ? threads : 1).detach();
+}
+
+bool index_lookup(const char *file_name, struct file_meta *meta){
+	index_mtx.lock_shared();
+	auto it = files.find(file_name);
+	if(it != files.end()){
+		*meta = it->second;
+		index_mtx.unlock_shared();
+		return true;
+	}
+	index_mtx.unlock_shared();
+
+	/* still scanning, or created behind the server's back: ask the filesystem */
+	if(!stat_file(file_name, meta)){
+		return false;
+	}
+	if(scanned){
+		index_mtx.lock();
+		files.emplace(file_name, *meta);
+		index_mtx.unlock();
+	}
+	return true;
+}
+
+void index_update(const char *file_name, long int file_size, const char *digest){
+	struct file_meta meta;
+	meta.file_size = file_size;
+	meta.mtime = time(NULL);
+	memcpy(meta.digest, digest, 2*MD5_DIGEST_LENGTH);
+	meta.digest[2*MD5_DIGEST_LENGTH] = '\0';
+	index_mtx.lock();
+	files[file_name] = meta;
+	index_mtx.unlock();
+}
+
+void index_insert(const char *file_name, const struct file_meta *meta){
+	index_mtx.lock();
+	files[file_name] = *meta;
+	index_mtx.unlock();
+}
+
+static bool write_all(int fd, const char* data, long int size){
+	while(size > 0){
+		long int count = write(fd, data, size);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			return false;
+		}
+		data += count;
+		size -= count;
+	}
+	return true;
+}
+
+bool index_list(int connfd, const char *prefix){
+	size_t prefix_size = strlen(prefix);
+	string next = prefix;
+	bool first = true;
+	string chunk;
+	while(1){
+		chunk.clear();
+		index_mtx.lock_shared();
+		auto it = first ? files.lower_bound(next) : files.upper_bound(next);
+		for(; it != files.end() && chunk.size() < LIST_CHUNK; ++it){
+			if(it->first.compare(0, prefix_size, prefix)){
+				break;
+			}
+			char line[128];
+			snprintf(line, sizeof(line), "\t%ld\t%ld\t%s\n", it->second.file_size, (long)it->second.mtime,
+				it->second.digest[0] ? it->second.digest : "-");
+			chunk += it->first;
+			chunk += line;
+			next = it->first;
+		}
+		bool done = it == files.end() || it->first.compare(0, prefix_size, prefix);
+		index_mtx.unlock_shared();
+		first = false;
+
+		if(!chunk.empty() && !write_all(connfd, chunk.data(), chunk.size())){
+			return false;
+		}
+		if(done){
+			return true;
+		}
+	}
+}
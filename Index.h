@@ -0,0 +1,46 @@
+#pragma once
+
+#include <openssl/md5.h>
+#include <time.h>
+
+/*
+ * What the server knows about one file without opening it.  digest is empty
+ * until the startup scan (or a PUT) has hashed the contents.
+ */
+struct file_meta
+{
+	long int file_size;
+	time_t   mtime;
+	char     digest[2*MD5_DIGEST_LENGTH+1];
+};
+
+/*
+ * index_build() - scan the server's directory in the background: list it,
+ *                 then stat and hash the files with threads workers.  Until
+ *                 the scan is done, lookups fall back to stat().
+ */
+void index_build(int threads);
+
+/*
+ * index_lookup() - fill meta for file_name.  Returns false if the file
+ *                  doesn't exist.
+ */
+bool index_lookup(const char *file_name, struct file_meta *meta);
+
+/*
+ * index_update() - record a file just written by a PUT
+ */
+void index_update(const char *file_name, long int file_size, const char *digest);
+
+/*
+ * index_insert() - record a file that has no directory entry of its own,
+ *                  such as one packed into a segment
+ */
+void index_insert(const char *file_name, const struct file_meta *meta);
+
+/*
+ * index_list() - stream "<name>\t<size>\t<mtime>\t<digest>" lines for every
+ *                indexed file whose name starts with prefix to connfd.
+ *                Returns false if the client went away.
+ */
+bool index_list(int connfd, const char *prefix);
@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include "LargeIO.h"
+#include "Pipeline.h"
+using namespace std;
+
+static long threshold = 0;
+static int pool_limit = 0;
+
+/*
+	Aligned blocks are recycled rather than freed, and capped in number, so
+	that a burst of huge transfers can't balloon the server's memory
+*/
+static mutex pool_mtx;
+static condition_variable pool_cv;
+static vector<char*> free_blocks;
+static int blocks_allocated = 0;
+
+static atomic<long> large_sends(0);
+static atomic<long> large_receives(0);
+static atomic<long> direct_opens(0);
+
+static char* get_block(bool wait){
+	unique_lock<mutex> lock(pool_mtx);
+	if(wait){
+		pool_cv.wait(lock, []{ return !free_blocks.empty() || blocks_allocated < pool_limit; });
+	}
+	else if(free_blocks.empty() && blocks_allocated >= pool_limit){
+		errno = EBUSY;
+		return NULL;
+	}
+	if(!free_blocks.empty()){
+		char* block = free_blocks.back();
+		free_blocks.pop_back();
+		return block;
+	}
+	void* block;
+	if(posix_memalign(&block, LARGE_IO_ALIGN, LARGE_IO_BLOCK)){
+		errno = ENOMEM;
+		return NULL;
+	}
+	blocks_allocated++;
+	return (char*)block;
+}
+
+static void put_block(char* block){
+	pool_mtx.lock();
+	free_blocks.push_back(block);
+	pool_mtx.unlock();
+	pool_cv.notify_one();
+}
+
+static bool is_direct(int fd){
+	return fcntl(fd, F_GETFL) & O_DIRECT;
+}
+
+/*
+	Without O_DIRECT the pages did go through the page cache - push them out
+	now that we are done with them
+*/
+static void drop_cached(int fd, long offset, long length, bool dirty){
+	if(is_direct(fd)){
+		return;
+	}
+	if(dirty){
+		sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	}
+	posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+static long read_block(int fd, char* block, long offset, long length){
+	long total = 0;
+	while(total < length){
+		long count = pread(fd, block + total, length - total, offset + total);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			return count < 0 ? -1 : total;
+		}
+		total += count;
+	}
+	return total;
+}
+
+static bool write_all(int fd, const char* data, long length){
+	while(length > 0){
+		long count = write(fd, data, length);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			return false;
+		}
+		data += count;
+		length -= count;
+	}
+	return true;
+}
+
+char *large_block_take(){
+	return get_block(false);
+}
+
+void large_block_put(char *block){
+	put_block(block);
+}
+
+bool large_read_block(int fd, char *block, long offset, long length){
+	/* O_DIRECT wants whole blocks; the last read just comes up short */
+	if(read_block(fd, block, offset, LARGE_IO_BLOCK) < length){
+		return false;
+	}
+	drop_cached(fd, offset, length, false);
+	return true;
+}
+
+int large_write_block(int fd, const char *block, long offset, long length){
+	/* O_DIRECT can only write whole blocks, so the tail goes through the page cache */
+	if(length % LARGE_IO_ALIGN && is_direct(fd)){
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+	}
+	while(length > 0){
+		long count = pwrite(fd, block, length, offset);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			return count < 0 ? errno : EIO;
+		}
+		drop_cached(fd, offset, count, true);
+		block += count;
+		offset += count;
+		length -= count;
+	}
+	return 0;
+}
+
+void large_io_init(long size, int buffers){
+	threshold = size;
+	pool_limit = buffers > 0 ? buffers : 1;
+}
+
+bool large_io_wanted(long file_size){
+	return threshold > 0 && file_size >= threshold;
+}
+
+int large_open(const char *file_name, int flags){
+	int fd = open(file_name, flags | O_DIRECT, 0644);
+	if(fd < 0 && errno == EINVAL){
+		/* e.g. tmpfs - fall back to buffered I/O plus fadvise */
+		fd = open(file_name, flags, 0644);
+		if(fd >= 0){
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+		return fd;
+	}
+	if(fd >= 0){
+		direct_opens++;
+	}
+	return fd;
+}
+
+bool large_digest(int fd, long file_size, char *hex){
+	char* block = get_block(true);
+	if(!block){
+		return false;
+	}
+	MD5_CTX mdContext;
+	MD5_Init(&mdContext);
+	bool ok = true;
+	for(long offset = 0; offset < file_size; offset += LARGE_IO_BLOCK){
+		long length = file_size - offset < LARGE_IO_BLOCK ? file_size - offset : LARGE_IO_BLOCK;
+		if(!large_read_block(fd, block, offset, length)){
+			ok = false;
+			break;
+		}
+		MD5_Update(&mdContext, block, length);
+	}
+	put_block(block);
+
+	md5_final_hex(&mdContext, hex);
+	return ok;
+}
+
+bool large_send(int connfd, int fd, long file_size){
+	char* block = get_block(true);
+	if(!block){
+		return false;
+	}
+	bool ok = true;
+	for(long offset = 0; offset < file_size; offset += LARGE_IO_BLOCK){
+		long length = file_size - offset < LARGE_IO_BLOCK ? file_size - offset : LARGE_IO_BLOCK;
+		if(!large_read_block(fd, block, offset, length) || !write_all(connfd, block, length)){
+			ok = false;
+			break;
+		}
+	}
+	put_block(block);
+	large_sends++;
+	return ok;
+}
+
+int large_receive(int connfd, int fd, long file_size, const char *head, long head_len, MD5_CTX *md5){
+	char* block = get_block(true);
+	if(!block){
+		return ENOMEM;
+	}
+	int err = 0;
+	long offset = 0;
+	if(head_len > file_size){
+		head_len = file_size;
+	}
+	while(offset < file_size && !err){
+		long length = file_size - offset < LARGE_IO_BLOCK ? file_size - offset : LARGE_IO_BLOCK;
+		long filled = 0;
+		if(head_len > 0){
+			filled = head_len < length ? head_len : length;
+			memcpy(block, head, filled);
+			head += filled;
+			head_len -= filled;
+		}
+		while(filled < length){
+			long count = read(connfd, block + filled, length - filled);
+			if(count < 0 && errno == EINTR){
+				continue;
+			}
+			if(count <= 0){
+				err = count < 0 ? errno : EPIPE;
+				break;
+			}
+			filled += count;
+		}
+		if(err){
+			break;
+		}
+		if(md5){
+			MD5_Update(md5, block, length);
+		}
+		err = large_write_block(fd, block, offset, length);
+		offset += length;
+	}
+	put_block(block);
+	large_receives++;
+	return err;
+}
+
+void large_io_print_stats(FILE *out){
+	pool_mtx.lock();
+	int allocated = blocks_allocated;
+	pool_mtx.unlock();
+	fprintf(out, "large io: %ld sends %ld receives %ld O_DIRECT opens, %d aligned blocks\n",
+		large_sends.load(), large_receives.load(), direct_opens.load(), allocated);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <openssl/md5.h>
+#include <stdio.h>
+
+/* Size of one aligned transfer block, and the alignment O_DIRECT needs */
+#define LARGE_IO_BLOCK (1 << 20)
+#define LARGE_IO_ALIGN 4096
+
+/*
+ * large_io_init() - files of at least threshold bytes bypass the page cache
+ *                   and the LRU cache.  At most buffers aligned blocks are
+ *                   ever in use at once.  A threshold of 0 disables this.
+ */
+void large_io_init(long threshold, int buffers);
+
+/*
+ * large_io_wanted() - true if a file of this size should use large-file I/O
+ */
+bool large_io_wanted(long file_size);
+
+/*
+ * large_open() - open a file for large-file I/O, with O_DIRECT if the
+ *                filesystem supports it.  Returns the fd, or -1 with errno set.
+ */
+int large_open(const char *file_name, int flags);
+
+/*
+ * large_block_take() - take an aligned LARGE_IO_BLOCK-byte block from the
+ *                      pool without waiting.  Returns NULL with errno
+ *                      EBUSY if every block is in use, or ENOMEM if a new
+ *                      one couldn't be allocated.
+ */
+char *large_block_take();
+
+/*
+ * large_block_put() - return a block from large_block_take() to the pool
+ */
+void large_block_put(char *block);
+
+/*
+ * large_read_block() - read length bytes of fd at offset, which is a
+ *                      multiple of LARGE_IO_BLOCK, into block, then drop
+ *                      them from the page cache.  Returns false on a short
+ *                      read.
+ */
+bool large_read_block(int fd, char *block, long offset, long length);
+
+/*
+ * large_write_block() - write length bytes of block to fd at offset, a
+ *                       multiple of LARGE_IO_BLOCK, then drop them from the
+ *                       page cache.  Returns 0, or an errno value.
+ */
+int large_write_block(int fd, const char *block, long offset, long length);
+
+/*
+ * large_digest() - MD5 the first file_size bytes of fd into a 32-character
+ *                  hex string (hex must hold 33 bytes)
+ */
+bool large_digest(int fd, long file_size, char *hex);
+
+/*
+ * large_send() - stream file_size bytes of fd to connfd, then drop them from
+ *                the page cache
+ */
+bool large_send(int connfd, int fd, long file_size);
+
+/*
+ * large_receive() - write file_size bytes to fd: first the head_len bytes
+ *                   already read into head, then the rest from connfd.  If
+ *                   md5 is not NULL the contents are added to it.  Returns 0,
+ *                   or an errno value.
+ */
+int large_receive(int connfd, int fd, long file_size, const char *head, long head_len, MD5_CTX *md5);
+
+/*
+ * large_io_print_stats() - dump the number of large transfers
+ */
+void large_io_print_stats(FILE *out);
@@ -0,0 +1,263 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "Memory.h"
+using namespace std;
+
+/* Slabs are aligned to their size, so a block finds its slab by masking its address */
+#define SLAB_SIZE (1 << 20)
+
+/* Size classes run from 64 bytes doubling up to 64 << (SLAB_CLASSES - 1) */
+#define SLAB_MIN_BLOCK 64
+#define SLAB_CLASSES 12
+
+/* Room at the start of each slab for its struct slab */
+#define SLAB_HEADER 64
+
+/* Scratch memory is handed out from chunks of this size */
+#define ARENA_CHUNK (16 * 1024)
+
+/* Marks a payload with a mapping of its own in its block_header */
+#define DIRECT_CLASS -1
+
+struct slab
+{
+	int          size_class;
+	int          live;
+	int          capacity;
+	int          carved;
+	char        *free_list;
+	struct slab *prev;
+	struct slab *next;
+};
+
+/* Precedes every payload, and keeps it 16-byte aligned */
+struct block_header
+{
+	int64_t size_class;
+	int64_t size;
+};
+
+/* Each class lists the slabs that still have a free block */
+struct slab_class
+{
+	struct slab *partial;
+	long int     slabs;
+	long int     live;
+};
+
+static mutex slab_mtx;
+static struct slab_class classes[SLAB_CLASSES];
+static atomic<long> payload_bytes(0);
+static atomic<long> direct_count(0);
+static atomic<long> direct_bytes(0);
+
+static atomic<long> arena_retained(0);
+static atomic<long> arena_peak(0);
+
+struct arena
+{
+	vector<char *> chunks;
+	size_t         used;
+	vector<void *> big;
+	size_t         request_bytes;
+};
+
+static thread_local struct arena scratch;
+
+void *arena_alloc(size_t size){
+	size = (size + 15) & ~(size_t)15;
+	scratch.request_bytes += size;
+	/* a request-sized buffer would waste most of a chunk */
+	if(size > ARENA_CHUNK / 2){
+		void *block = malloc(size);
+		scratch.big.push_back(block);
+		return block;
+	}
+	if(scratch.chunks.empty() || scratch.used + size > ARENA_CHUNK){
+		scratch.chunks.push_back((char *)malloc(ARENA_CHUNK));
+		scratch.used = 0;
+		arena_retained += ARENA_CHUNK;
+	}
+	void *block = scratch.chunks.back() + scratch.used;
+	scratch.used += size;
+	return block;
+}
+
+void arena_reset(){
+	for(void *block : scratch.big){
+		free(block);
+	}
+	scratch.big.clear();
+	for(size_t i = 1; i < scratch.chunks.size(); i++){
+		free(scratch.chunks[i]);
+		arena_retained -= ARENA_CHUNK;
+	}
+	if(scratch.chunks.size() > 1){
+		scratch.chunks.resize(1);
+	}
+	scratch.used = 0;
+	long int peak = arena_peak.load();
+	while((long int)scratch.request_bytes > peak && !arena_peak.compare_exchange_weak(peak, scratch.request_bytes)){
+	}
+	scratch.request_bytes = 0;
+}
+
+static size_t block_size(int size_class){
+	return (size_t)SLAB_MIN_BLOCK << size_class;
+}
+
+/* map twice the size and trim, to get a slab aligned to SLAB_SIZE */
+static struct slab *new_slab(int size_class){
+	char *mapped = (char *)mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mapped == MAP_FAILED){
+		return NULL;
+	}
+	char *aligned = (char *)(((uintptr_t)mapped + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+	if(aligned > mapped){
+		munmap(mapped, aligned - mapped);
+	}
+	munmap(aligned + SLAB_SIZE, mapped + 2 * SLAB_SIZE - (aligned + SLAB_SIZE));
+	struct slab *s = (struct slab *)aligned;
+	s->size_class = size_class;
+	s->live = 0;
+	s->capacity = (SLAB_SIZE - SLAB_HEADER) / block_size(size_class);
+	s->carved = 0;
+	s->free_list = NULL;
+	s->prev = NULL;
+	s->next = NULL;
+	classes[size_class].slabs++;
+	return s;
+}
+
+static void unlink_partial(struct slab *s){
+	struct slab_class *c = &classes[s->size_class];
+	if(s->prev){
+		s->prev->next = s->next;
+	}
+	else{
+		c->partial = s->next;
+	}
+	if(s->next){
+		s->next->prev = s->prev;
+	}
+	s->prev = s->next = NULL;
+}
+
+static void push_partial(struct slab *s){
+	struct slab_class *c = &classes[s->size_class];
+	s->prev = NULL;
+	s->next = c->partial;
+	if(c->partial){
+		c->partial->prev = s;
+	}
+	c->partial = s;
+}
+
+char *slab_alloc(size_t size){
+	size_t needed = size + sizeof(struct block_header);
+	int size_class = 0;
+	while(size_class < SLAB_CLASSES && block_size(size_class) < needed){
+		size_class++;
+	}
+
+	struct block_header *header;
+	if(size_class == SLAB_CLASSES){
+		void *mapped = mmap(NULL, needed, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mapped == MAP_FAILED){
+			return NULL;
+		}
+		header = (struct block_header *)mapped;
+		header->size_class = DIRECT_CLASS;
+		direct_count++;
+		direct_bytes += needed;
+	}
+	else{
+		lock_guard<mutex> lock(slab_mtx);
+		struct slab_class *c = &classes[size_class];
+		struct slab *s = c->partial;
+		if(!s){
+			s = new_slab(size_class);
+			if(!s){
+				return NULL;
+			}
+			push_partial(s);
+		}
+		char *block;
+		if(s->free_list){
+			block = s->free_list;
+			s->free_list = *(char **)block;
+		}
+		else{
+			block = (char *)s + SLAB_HEADER + s->carved++ * block_size(size_class);
+		}
+		if(++s->live == s->capacity){
+			unlink_partial(s);
+		}
+		c->live++;
+		header = (struct block_header *)block;
+		header->size_class = size_class;
+	}
+	header->size = needed;
+	payload_bytes += size;
+	return (char *)(header + 1);
+}
+
+void slab_free(char *payload){
+	if(!payload){
+		return;
+	}
+	struct block_header *header = (struct block_header *)payload - 1;
+	payload_bytes -= header->size - sizeof(struct block_header);
+	if(header->size_class == DIRECT_CLASS){
+		direct_count--;
+		direct_bytes -= header->size;
+		munmap(header, header->size);
+		return;
+	}
+
+	lock_guard<mutex> lock(slab_mtx);
+	struct slab *s = (struct slab *)((uintptr_t)header & ~(uintptr_t)(SLAB_SIZE - 1));
+	struct slab_class *c = &classes[s->size_class];
+	if(s->live == s->capacity){
+		push_partial(s);
+	}
+	*(char **)header = s->free_list;
+	s->free_list = (char *)header;
+	s->live--;
+	c->live--;
+
+	/* one empty slab is kept per class, so a class hovering at a boundary doesn't map and unmap */
+	if(!s->live && (s->prev || s->next)){
+		unlink_partial(s);
+		c->slabs--;
+		munmap(s, SLAB_SIZE);
+	}
+}
+
+void memory_print_stats(FILE *out){
+	long int slab_bytes = 0;
+	long int block_bytes = 0;
+	slab_mtx.lock();
+	for(int i = 0; i < SLAB_CLASSES; i++){
+		slab_bytes += classes[i].slabs * SLAB_SIZE;
+		block_bytes += classes[i].live * block_size(i);
+	}
+	fprintf(out, "memory: %ld payload bytes cached, %ld slabs (%.1f%% of slab space in use), %ld large payloads mapped (%ld bytes)\n",
+		payload_bytes.load(), slab_bytes / SLAB_SIZE, slab_bytes ? 100.0 * block_bytes / slab_bytes : 0.0,
+		direct_count.load(), direct_bytes.load());
+	for(int i = 0; i < SLAB_CLASSES; i++){
+		if(classes[i].slabs){
+			fprintf(out, "memory:   %7zu-byte class: %ld slabs, %ld blocks live\n", block_size(i),
+				classes[i].slabs, classes[i].live);
+		}
+	}
+	slab_mtx.unlock();
+	fprintf(out, "memory: request arenas retain %ld bytes, largest request used %ld bytes of scratch\n",
+		arena_retained.load(), arena_peak.load());
+}
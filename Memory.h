@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * arena_alloc() - scratch memory for the request this thread is serving.
+ *                 It is never freed by itself: everything allocated is
+ *                 released at once by arena_reset().
+ */
+void *arena_alloc(size_t size);
+
+/*
+ * arena_reset() - release this thread's scratch memory.  One chunk is kept
+ *                 for the next request, so a worker's footprint stays flat.
+ */
+void arena_reset();
+
+/*
+ * slab_alloc() - memory for a cache payload, from the slab of its size
+ *                class.  Payloads too big for a slab get their own mapping,
+ *                which goes straight back to the system when freed.
+ */
+char *slab_alloc(size_t size);
+
+/*
+ * slab_free() - release memory from slab_alloc().  A slab left empty is
+ *               returned to the system unless it is the last one of its
+ *               size class with room.
+ */
+void slab_free(char *payload);
+
+/*
+ * memory_print_stats() - dump slab occupancy and arena usage
+ */
+void memory_print_stats(FILE *out);
@@ -0,0 +1,805 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/md5.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Durability.h"
+#include "Index.h"
+#include "Memory.h"
+#include "Pack.h"
+#include "Pipeline.h"
+#include "Trace.h"
+using namespace std;
+
+/* Where the segments and the checkpoint live; the index scan skips dot names */
+#define PACK_DIR ".segments"
+#define PACK_CHECKPOINT PACK_DIR "/checkpoint"
+
+/* A segment stops taking records once it reaches this size */
+#define SEGMENT_SIZE (64L << 20)
+
+/* Seconds between rounds of compaction and checkpointing */
+#define PACK_INTERVAL 10
+
+/* Sealed segments with less than this share of their bytes live are compacted */
+#define COMPACT_LIVE_RATIO 0.5
+
+#define RECORD_MAGIC "FSPK"
+#define CHECKPOINT_MAGIC "FSPKIDX1"
+
+/* data_size of a record saying the name is no longer packed */
+#define TOMBSTONE -1
+
+/*
+	Every record starts with this header, then the name, then the contents.
+	seq orders records across segments: a record copied by compaction keeps
+	its seq, so replay never lets an older copy win over a newer PUT.
+*/
+struct pack_record
+{
+	char     magic[4];
+	uint32_t name_size;
+	int64_t  data_size;
+	uint64_t seq;
+	int64_t  mtime;
+	char     digest[2*MD5_DIGEST_LENGTH];
+};
+
+/*
+	A checkpoint is this header, segment_count checkpoint_segments giving how
+	much of each segment it covers, entry_count checkpoint_entries each
+	followed by its name, and an MD5 of all of that
+*/
+struct checkpoint_header
+{
+	char     magic[8];
+	uint64_t next_seq;
+	uint64_t segment_count;
+	uint64_t entry_count;
+};
+
+struct checkpoint_segment
+{
+	uint32_t id;
+	uint32_t unused;
+	int64_t  length;
+};
+
+struct checkpoint_entry
+{
+	uint32_t name_size;
+	uint32_t segment;
+	int64_t  offset;
+	int64_t  data_size;
+	uint64_t seq;
+	int64_t  mtime;
+	char     digest[2*MD5_DIGEST_LENGTH];
+};
+
+/* readers hold a reference while they pread, so a compacted segment is only closed after them */
+struct segment
+{
+	uint32_t id;
+	int      fd;
+	long int length;  /* bytes of records written */
+	long int live;    /* bytes of records the map still points to */
+	long int synced;  /* bytes known to be on stable storage */
+
+	~segment() {
+		close(fd);
+	}
+};
+
+struct pack_entry
+{
+	shared_ptr<struct segment> seg;
+	long int offset;  /* of the record */
+	uint32_t name_size;
+	long int data_size;
+	uint64_t seq;
+	time_t   mtime;
+	char     digest[2*MD5_DIGEST_LENGTH+1];
+};
+
+static atomic<long> threshold(0);
+
+/* set once the log has been recovered (or packing given up on); until then pack calls wait */
+static mutex ready_mtx;
+static condition_variable ready_cv;
+static atomic<bool> ready(false);
+
+static mutex pack_mtx;
+static unordered_map<string, struct pack_entry> entries;
+static map<uint32_t, shared_ptr<struct segment> > segments;
+static shared_ptr<struct segment> active;
+static uint32_t last_id = 0;
+static uint64_t next_seq = 1;
+static bool dirty = false;
+
+/* one checkpoint at a time, whether periodic, after a compaction or at shutdown */
+static mutex checkpoint_mtx;
+
+static atomic<long> appended(0);
+static atomic<long> reads(0);
+static atomic<long> compactions(0);
+static atomic<long> reclaimed(0);
+static atomic<long> checkpoints(0);
+
+static long int record_size(uint32_t name_size, long int data_size){
+	return sizeof(struct pack_record) + name_size + (data_size > 0 ? data_size : 0);
+}
+
+static void segment_path(uint32_t id, char *path, size_t size){
+	snprintf(path, size, "%s/segment.%06u", PACK_DIR, id);
+}
+
+static void sync_directory(){
+	int fd = open(PACK_DIR, O_RDONLY | O_DIRECTORY);
+	if(fd >= 0){
+		fsync(fd);
+		close(fd);
+	}
+}
+
+static shared_ptr<struct segment> open_segment(uint32_t id, bool create){
+	char path[64];
+	segment_path(id, path, sizeof(path));
+	int fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+	if(fd < 0){
+		return NULL;
+	}
+	struct stat info;
+	fstat(fd, &info);
+	shared_ptr<struct segment> seg = make_shared<struct segment>();
+	seg->id = id;
+	seg->fd = fd;
+	seg->length = info.st_size;
+	seg->live = 0;
+	seg->synced = create ? 0 : info.st_size;
+	return seg;
+}
+
+/*
+	A sealed segment is synced as it is sealed, so that committing the
+	active segment is all pack_commit() ever has to do.  The caller holds
+	pack_mtx.
+*/
+static int roll_segment_locked(){
+	if(active && fdatasync(active->fd) < 0){
+		return errno;
+	}
+	if(active){
+		active->synced = active->length;
+	}
+	shared_ptr<struct segment> seg = open_segment(last_id + 1, true);
+	if(!seg){
+		int err = errno;
+		perror("Error creating segment");
+		return err;
+	}
+	sync_directory();
+	last_id = seg->id;
+	segments[seg->id] = seg;
+	active = seg;
+	return 0;
+}
+
+/*
+	Records are written under pack_mtx, one after the other, so the only
+	damage a crash can do is a torn record at the very end of the log
+*/
+static int append_locked(struct iovec *parts, int count, long int size, shared_ptr<struct segment> *seg,
+	long int *offset){
+	if(!active || (active->length > 0 && active->length + size > SEGMENT_SIZE)){
+		int err = roll_segment_locked();
+		if(err){
+			return err;
+		}
+	}
+	long int written = pwritev(active->fd, parts, count, active->length);
+	if(written != size){
+		/* the next record goes over whatever part of this one made it */
+		return written < 0 ? errno : EIO;
+	}
+	*seg = active;
+	*offset = active->length;
+	active->length += size;
+	return 0;
+}
+
+/*
+	Point name at the record at offset in seg, unless the map already holds a
+	newer one, and move the live byte counts to match.  The caller holds
+	pack_mtx.  Returns true if name was packed before.
+*/
+static bool apply_locked(const string &name, const struct pack_record *header, const shared_ptr<struct segment> &seg,
+	long int offset){
+	auto it = entries.find(name);
+	bool existed = it != entries.end();
+	if(existed){
+		if(header->seq < it->second.seq){
+			return true;
+		}
+		it->second.seg->live -= record_size(it->second.name_size, it->second.data_size);
+	}
+	if(header->data_size == TOMBSTONE){
+		if(existed){
+			entries.erase(it);
+		}
+		return existed;
+	}
+	struct pack_entry entry;
+	entry.seg = seg;
+	entry.offset = offset;
+	entry.name_size = header->name_size;
+	entry.data_size = header->data_size;
+	entry.seq = header->seq;
+	entry.mtime = header->mtime;
+	memcpy(entry.digest, header->digest, 2*MD5_DIGEST_LENGTH);
+	entry.digest[2*MD5_DIGEST_LENGTH] = '\0';
+	seg->live += record_size(entry.name_size, entry.data_size);
+	entries[name] = entry;
+	return existed;
+}
+
+/*
+	A new server starts accepting before it has the log, so anything that
+	has to know what is packed waits here for recovery.  Returns false if
+	packing is off.
+*/
+static bool wait_ready(){
+	if(!threshold){
+		return false;
+	}
+	if(!ready){
+		unique_lock<mutex> lock(ready_mtx);
+		ready_cv.wait(lock, []{ return ready.load(); });
+	}
+	return threshold > 0;
+}
+
+bool pack_wanted(long file_size){
+	return wait_ready() && file_size <= threshold;
+}
+
+int pack_put(const char *file_name, const char *contents, long file_size, const char *digest){
+	struct pack_record header;
+	memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+	header.name_size = strlen(file_name);
+	header.data_size = file_size;
+	header.mtime = time(NULL);
+	memcpy(header.digest, digest, 2*MD5_DIGEST_LENGTH);
+	struct iovec parts[3] = {
+		{ &header, sizeof(header) }, { (void *)file_name, header.name_size }, { (void *)contents, (size_t)file_size }
+	};
+	shared_ptr<struct segment> seg;
+	long int offset;
+
+	trace_begin(TRACE_DISK_WRITE);
+	pack_mtx.lock();
+	header.seq = next_seq++;
+	int err = append_locked(parts, 3, record_size(header.name_size, file_size), &seg, &offset);
+	if(!err){
+		apply_locked(file_name, &header, seg, offset);
+		dirty = true;
+	}
+	pack_mtx.unlock();
+	trace_end(TRACE_DISK_WRITE);
+	if(err){
+		fprintf(stderr, "PUT - Error packing %s: %s\n", file_name, strerror(err));
+		return err;
+	}
+	appended++;
+	return 0;
+}
+
+int pack_commit(){
+	pack_mtx.lock();
+	shared_ptr<struct segment> seg = active;
+	pack_mtx.unlock();
+	if(!seg){
+		return 0;
+	}
+	trace_begin(TRACE_FLUSH);
+	int err = durability_commit(seg->fd, NULL);
+	trace_end(TRACE_FLUSH);
+	return err;
+}
+
+char *pack_read(const char *file_name, long *file_size, char *digest){
+	if(!wait_ready()){
+		return NULL;
+	}
+	pack_mtx.lock();
+	auto it = entries.find(file_name);
+	if(it == entries.end()){
+		pack_mtx.unlock();
+		return NULL;
+	}
+	shared_ptr<struct segment> seg = it->second.seg;
+	long int offset = it->second.offset + sizeof(struct pack_record) + it->second.name_size;
+	long int size = it->second.data_size;
+	strcpy(digest, it->second.digest);
+	pack_mtx.unlock();
+
+	char *contents = slab_alloc(size + 1);
+	if(!contents){
+		return NULL;
+	}
+	trace_begin(TRACE_DISK_READ);
+	long int received = 0;
+	while(received < size){
+		long int count = pread(seg->fd, contents + received, size - received, offset + received);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			break;
+		}
+		received += count;
+	}
+	trace_end(TRACE_DISK_READ);
+	if(received < size){
+		perror("Error reading packed file");
+		slab_free(contents);
+		return NULL;
+	}
+	contents[size] = '\0';
+	*file_size = size;
+	reads++;
+	return contents;
+}
+
+void pack_unshadow(const char *file_name){
+	if(!wait_ready()){
+		return;
+	}
+	/* a PUT writing a file of its own unpacks the name first, so that file is never the one removed */
+	lock_guard<mutex> lock(pack_mtx);
+	if(entries.count(file_name)){
+		unlink(file_name);
+	}
+}
+
+/*
+	Append a tombstone for file_name and drop it from the map.  The caller
+	holds pack_mtx.  Returns 0, or the errno of the append.
+*/
+static int unpack_locked(const char *file_name){
+	struct pack_record header;
+	memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+	header.name_size = strlen(file_name);
+	header.data_size = TOMBSTONE;
+	header.mtime = time(NULL);
+	memset(header.digest, '0', sizeof(header.digest));
+	header.seq = next_seq++;
+	struct iovec parts[2] = { { &header, sizeof(header) }, { (void *)file_name, header.name_size } };
+	shared_ptr<struct segment> seg;
+	long int offset;
+	int err = append_locked(parts, 2, record_size(header.name_size, TOMBSTONE), &seg, &offset);
+	if(err){
+		fprintf(stderr, "PUT - Error unpacking %s: %s\n", file_name, strerror(err));
+		return err;
+	}
+	apply_locked(file_name, &header, seg, offset);
+	dirty = true;
+	return 0;
+}
+
+int pack_remove(const char *file_name, bool *unpacked){
+	*unpacked = false;
+	if(!wait_ready()){
+		return 0;
+	}
+	lock_guard<mutex> lock(pack_mtx);
+	if(!entries.count(file_name)){
+		return 0;
+	}
+	int err = unpack_locked(file_name);
+	*unpacked = !err;
+	return err;
+}
+
+int pack_install(const char *temp_name, const char *file_name, bool *unpacked){
+	*unpacked = false;
+	if(!wait_ready()){
+		return rename(temp_name, file_name) < 0 ? errno : 0;
+	}
+	/* readers look a name up under pack_mtx, so none finds the packed copy once the new file is in place */
+	lock_guard<mutex> lock(pack_mtx);
+	bool packed = entries.count(file_name);
+	if(rename(temp_name, file_name) < 0){
+		return errno;
+	}
+	if(!packed){
+		return 0;
+	}
+	int err = unpack_locked(file_name);
+	*unpacked = !err;
+	return err;
+}
+
+/*
+	Everything the checkpoint covers is synced before it is written, and it
+	is written to a temporary file and renamed, so the checkpoint on disk is
+	always whole and never points past what survived a crash
+*/
+bool pack_checkpoint(){
+	/* nothing has changed if recovery hasn't even finished */
+	if(!threshold || !ready){
+		return true;
+	}
+	lock_guard<mutex> one_at_a_time(checkpoint_mtx);
+	string image;
+	vector<shared_ptr<struct segment> > unsynced;
+	vector<long int> lengths;
+
+	pack_mtx.lock();
+	struct checkpoint_header header;
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.next_seq = next_seq;
+	header.segment_count = segments.size();
+	header.entry_count = entries.size();
+	image.append((char *)&header, sizeof(header));
+	for(auto &it : segments){
+		struct checkpoint_segment covered = { it.first, 0, it.second->length };
+		image.append((char *)&covered, sizeof(covered));
+		if(it.second->synced < it.second->length){
+			unsynced.push_back(it.second);
+			lengths.push_back(it.second->length);
+		}
+	}
+	for(auto &it : entries){
+		struct checkpoint_entry entry;
+		entry.name_size = it.second.name_size;
+		entry.segment = it.second.seg->id;
+		entry.offset = it.second.offset;
+		entry.data_size = it.second.data_size;
+		entry.seq = it.second.seq;
+		entry.mtime = it.second.mtime;
+		memcpy(entry.digest, it.second.digest, 2*MD5_DIGEST_LENGTH);
+		image.append((char *)&entry, sizeof(entry));
+		image.append(it.first);
+	}
+	dirty = false;
+	pack_mtx.unlock();
+
+	bool written = true;
+	for(size_t i = 0; i < unsynced.size() && written; i++){
+		written = fdatasync(unsynced[i]->fd) == 0;
+		if(written){
+			pack_mtx.lock();
+			if(unsynced[i]->synced < lengths[i]){
+				unsynced[i]->synced = lengths[i];
+			}
+			pack_mtx.unlock();
+		}
+	}
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	MD5((const unsigned char *)image.data(), image.size(), digest);
+	image.append((char *)digest, sizeof(digest));
+
+	string temp_path = string(PACK_CHECKPOINT) + ".tmp";
+	int fd = written ? open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	written = fd >= 0 && write(fd, image.data(), image.size()) == (ssize_t)image.size();
+	if(fd >= 0){
+		written = fsync(fd) == 0 && written;
+		written = close(fd) == 0 && written;
+	}
+	if(!written || rename(temp_path.c_str(), PACK_CHECKPOINT) < 0){
+		perror("Error writing pack checkpoint");
+		unlink(temp_path.c_str());
+		pack_mtx.lock();
+		dirty = true;
+		pack_mtx.unlock();
+		return false;
+	}
+	sync_directory();
+	checkpoints++;
+	return true;
+}
+
+/* load the newest checkpoint into the map, and note how much of each segment it covers */
+static bool load_checkpoint(map<uint32_t, long int> *covered){
+	int fd = open(PACK_CHECKPOINT, O_RDONLY);
+	if(fd < 0){
+		return false;
+	}
+	struct stat info;
+	fstat(fd, &info);
+	string image(info.st_size, '\0');
+	bool loaded = pread(fd, &image[0], image.size(), 0) == (ssize_t)image.size();
+	close(fd);
+	if(!loaded || image.size() < sizeof(struct checkpoint_header) + MD5_DIGEST_LENGTH){
+		return false;
+	}
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	size_t body_size = image.size() - MD5_DIGEST_LENGTH;
+	MD5((const unsigned char *)image.data(), body_size, digest);
+	struct checkpoint_header header;
+	memcpy(&header, image.data(), sizeof(header));
+	if(memcmp(digest, image.data() + body_size, MD5_DIGEST_LENGTH) ||
+		memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic))){
+		fprintf(stderr, "%s", "pack: ignoring a damaged checkpoint, replaying every segment\n");
+		return false;
+	}
+
+	size_t position = sizeof(header);
+	for(uint64_t i = 0; i < header.segment_count && position + sizeof(struct checkpoint_segment) <= body_size; i++){
+		struct checkpoint_segment seg;
+		memcpy(&seg, image.data() + position, sizeof(seg));
+		position += sizeof(seg);
+		(*covered)[seg.id] = seg.length;
+	}
+	for(uint64_t i = 0; i < header.entry_count && position + sizeof(struct checkpoint_entry) <= body_size; i++){
+		struct checkpoint_entry entry;
+		memcpy(&entry, image.data() + position, sizeof(entry));
+		position += sizeof(entry);
+		string name = image.substr(position, entry.name_size);
+		position += entry.name_size;
+		auto seg = segments.find(entry.segment);
+		if(seg == segments.end()){
+			continue;
+		}
+		struct pack_record record;
+		record.name_size = entry.name_size;
+		record.data_size = entry.data_size;
+		record.seq = entry.seq;
+		record.mtime = entry.mtime;
+		memcpy(record.digest, entry.digest, sizeof(record.digest));
+		apply_locked(name, &record, seg->second, entry.offset);
+	}
+	next_seq = header.next_seq;
+	return true;
+}
+
+/*
+	Apply the records from offset to the end of seg.  The first record that
+	is cut short or doesn't match its MD5 is where a crash interrupted the
+	log, and the segment is truncated there.  Returns the records applied.
+*/
+static long replay(const shared_ptr<struct segment> &seg, long int offset){
+	long applied = 0;
+	vector<char> record;
+	while(offset + (long int)sizeof(struct pack_record) <= seg->length){
+		struct pack_record header;
+		if(pread(seg->fd, &header, sizeof(header), offset) != sizeof(header) ||
+			memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic)) || header.data_size < TOMBSTONE ||
+			offset + record_size(header.name_size, header.data_size) > seg->length){
+			break;
+		}
+		long int size = record_size(header.name_size, header.data_size) - sizeof(header);
+		record.resize(size);
+		if(pread(seg->fd, record.data(), size, offset + sizeof(header)) != size){
+			break;
+		}
+		if(header.data_size != TOMBSTONE){
+			char digest[2*MD5_DIGEST_LENGTH+1];
+			md5_hex(record.data() + header.name_size, header.data_size, digest);
+			if(memcmp(digest, header.digest, 2*MD5_DIGEST_LENGTH)){
+				break;
+			}
+		}
+		apply_locked(string(record.data(), header.name_size), &header, seg, offset);
+		if(header.seq >= next_seq){
+			next_seq = header.seq + 1;
+		}
+		offset += record_size(header.name_size, header.data_size);
+		applied++;
+	}
+	if(offset < seg->length){
+		fprintf(stderr, "pack: dropping %ld torn bytes at the end of segment %u\n", seg->length - offset, seg->id);
+		if(ftruncate(seg->fd, offset) < 0){
+			perror("Error truncating segment");
+		}
+		seg->length = offset;
+		seg->synced = offset;
+	}
+	return applied;
+}
+
+static void recover(){
+	map<uint32_t, long int> covered;
+	bool checkpointed = load_checkpoint(&covered);
+	long replayed = 0;
+	for(auto &it : segments){
+		auto start = covered.find(it.first);
+		long int offset = start == covered.end() ? 0 : start->second;
+		replayed += replay(it.second, offset < it.second->length ? offset : it.second->length);
+	}
+	if(!segments.empty() && segments.rbegin()->second->length < SEGMENT_SIZE){
+		active = segments.rbegin()->second;
+	}
+	fprintf(stderr, "pack: %zu files in %zu segments, %ld records replayed %s\n", entries.size(), segments.size(),
+		replayed, checkpointed ? "after the checkpoint" : "without a checkpoint");
+
+	/* packed files have no directory entry for the index scan to find */
+	for(auto &it : entries){
+		struct file_meta meta;
+		meta.file_size = it.second.data_size;
+		meta.mtime = it.second.mtime;
+		strcpy(meta.digest, it.second.digest);
+		index_insert(it.first.c_str(), &meta);
+	}
+}
+
+/*
+	Copy the records still live in victim to the active segment, then
+	checkpoint so that nothing refers to victim any more, and only then
+	remove it.  Readers part way through a pread keep its fd open.
+*/
+static void compact(const shared_ptr<struct segment> &victim){
+	vector<pair<string, struct pack_entry> > live;
+	pack_mtx.lock();
+	for(auto &it : entries){
+		if(it.second.seg == victim){
+			live.push_back(it);
+		}
+	}
+	pack_mtx.unlock();
+
+	vector<char> record;
+	for(auto &it : live){
+		long int size = record_size(it.second.name_size, it.second.data_size);
+		record.resize(size);
+		if(pread(victim->fd, record.data(), size, it.second.offset) != size){
+			perror("Error compacting segment");
+			return;
+		}
+		struct pack_record *header = (struct pack_record *)record.data();
+		struct iovec part = { record.data(), (size_t)size };
+		shared_ptr<struct segment> seg;
+		long int offset;
+		pack_mtx.lock();
+		/* skip anything overwritten since it was listed */
+		auto now = entries.find(it.first);
+		int err = 0;
+		if(now != entries.end() && now->second.seg == victim && now->second.offset == it.second.offset){
+			err = append_locked(&part, 1, size, &seg, &offset);
+			if(!err){
+				apply_locked(it.first, header, seg, offset);
+				dirty = true;
+			}
+		}
+		pack_mtx.unlock();
+		if(err){
+			fprintf(stderr, "pack: error compacting segment %u: %s\n", victim->id, strerror(err));
+			return;
+		}
+	}
+	if(!pack_checkpoint()){
+		return;
+	}
+	char path[64];
+	segment_path(victim->id, path, sizeof(path));
+	pack_mtx.lock();
+	segments.erase(victim->id);
+	pack_mtx.unlock();
+	unlink(path);
+	compactions++;
+	reclaimed += victim->length;
+}
+
+static void maintain(){
+	while(1){
+		sleep(PACK_INTERVAL);
+		vector<shared_ptr<struct segment> > victims;
+		pack_mtx.lock();
+		for(auto &it : segments){
+			struct segment *seg = it.second.get();
+			if(it.second != active && seg->live < seg->length * COMPACT_LIVE_RATIO){
+				victims.push_back(it.second);
+			}
+		}
+		bool changed = dirty;
+		pack_mtx.unlock();
+		for(auto &victim : victims){
+			compact(victim);
+		}
+		if(changed && victims.empty()){
+			pack_checkpoint();
+		}
+	}
+}
+
+static void become_ready(long packing_threshold){
+	ready_mtx.lock();
+	threshold = packing_threshold;
+	ready = true;
+	ready_mtx.unlock();
+	ready_cv.notify_all();
+}
+
+/*
+	Runs in the background so that a hot restart's new server is accepting
+	while the old one drains, which may take a while: two servers appending
+	to one log would corrupt it, so this waits until the old one has exited.
+*/
+static void open_log(long packing_threshold){
+	if(mkdir(PACK_DIR, 0755) < 0 && errno != EEXIST){
+		perror("Error creating " PACK_DIR);
+		become_ready(0);
+		return;
+	}
+	int lock_fd = open(PACK_DIR, O_RDONLY | O_DIRECTORY);
+	if(lock_fd < 0){
+		perror("Error opening " PACK_DIR);
+		become_ready(0);
+		return;
+	}
+	if(flock(lock_fd, LOCK_EX | LOCK_NB) < 0){
+		fprintf(stderr, "%s", "pack: waiting for the previous server to let go of " PACK_DIR "\n");
+		flock(lock_fd, LOCK_EX);
+	}
+
+	DIR* directory = opendir(PACK_DIR);
+	struct dirent* dirent;
+	while(directory && (dirent = readdir(directory))){
+		unsigned id;
+		if(sscanf(dirent->d_name, "segment.%u", &id) != 1){
+			continue;
+		}
+		shared_ptr<struct segment> seg = open_segment(id, false);
+		if(!seg){
+			perror("Error opening segment");
+			continue;
+		}
+		segments[id] = seg;
+		if(id > last_id){
+			last_id = id;
+		}
+	}
+	if(directory){
+		closedir(directory);
+	}
+	recover();
+	become_ready(packing_threshold);
+	maintain();
+}
+
+void pack_init(long packing_threshold){
+	if(packing_threshold <= 0){
+		return;
+	}
+	threshold = packing_threshold;
+	thread(open_log, packing_threshold).detach();
+}
+
+void pack_print_stats(FILE *out){
+	if(!threshold){
+		return;
+	}
+	if(!ready){
+		fprintf(out, "%s", "pack: still recovering " PACK_DIR "\n");
+		return;
+	}
+	pack_mtx.lock();
+	long int length = 0;
+	long int live = 0;
+	for(auto &it : segments){
+		length += it.second->length;
+		live += it.second->live;
+	}
+	fprintf(out, "pack: %zu files in %zu segments, %.1f%% of %ld segment bytes live\n", entries.size(),
+		segments.size(), length ? 100.0 * live / length : 0.0, length);
+	pack_mtx.unlock();
+	fprintf(out, "pack: %ld appends, %ld reads, %ld compactions reclaimed %ld bytes, %ld checkpoints\n",
+		appended.load(), reads.load(), compactions.load(), reclaimed.load(), checkpoints.load());
+}
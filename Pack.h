@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * Small files can be packed into append-only segment files under
+ * .segments instead of getting a file of their own.  Each PUT appends one
+ * record - header, name, contents - to the active segment, and an
+ * in-memory map takes the name to the record.  The map is checkpointed
+ * periodically; at startup the newest checkpoint is loaded and the records
+ * appended after it are replayed.  Segments that are mostly overwritten
+ * records are compacted in the background.
+ */
+
+/*
+ * pack_init() - pack files of at most threshold bytes (0 leaves packing
+ *               off).  Returns at once: a background thread waits for any
+ *               other server using .segments to let go of it, recovers the
+ *               map, adds the packed files to the metadata index, and then
+ *               checkpoints and compacts.  The other pack calls wait for
+ *               recovery to finish.
+ */
+void pack_init(long threshold);
+
+/*
+ * pack_wanted() - true if a file of this size should be packed
+ */
+bool pack_wanted(long file_size);
+
+/*
+ * pack_put() - append file_size bytes of contents as file_name, with its
+ *              hex MD5.  From then on the packed copy shadows any file of
+ *              its own by that name, which pack_unshadow() removes once the
+ *              record is durable.  Returns 0, or an errno value.
+ */
+int pack_put(const char *file_name, const char *contents, long file_size, const char *digest);
+
+/*
+ * pack_commit() - wait until everything packed so far is as durable as the
+ *                 server was asked to make PUTs.  Returns 0, or the errno of
+ *                 the flush that failed.
+ */
+int pack_commit();
+
+/*
+ * pack_unshadow() - remove the file of its own that file_name's packed copy
+ *                   replaced, if file_name is still packed
+ */
+void pack_unshadow(const char *file_name);
+
+/*
+ * pack_read() - read a packed file with a single pread from its segment.
+ *               Returns the contents NUL-terminated in a slab_alloc()
+ *               buffer, with its size and hex MD5 (digest must hold 33
+ *               bytes), or NULL if file_name isn't packed.
+ */
+char *pack_read(const char *file_name, long *file_size, char *digest);
+
+/*
+ * pack_remove() - forget file_name, which a PUT is about to write in place
+ *                 as a file of its own, so that nothing reads the packed
+ *                 copy once the new contents start to appear.  unpacked is
+ *                 set if there was a packed copy, whose tombstone the
+ *                 caller makes durable with pack_commit() once its own file
+ *                 is.  Returns 0, or an errno value.
+ */
+int pack_remove(const char *file_name, bool *unpacked);
+
+/*
+ * pack_install() - rename temp_name over file_name and forget any packed
+ *                  copy of file_name in one step, so that no reader finds
+ *                  the old packed copy after the new file is in place.
+ *                  unpacked is set as for pack_remove().  Returns 0, or an
+ *                  errno value.
+ */
+int pack_install(const char *temp_name, const char *file_name, bool *unpacked);
+
+/*
+ * pack_checkpoint() - write the map to .segments/checkpoint, so that the
+ *                     next start only has to replay what comes after it
+ */
+bool pack_checkpoint();
+
+/*
+ * pack_print_stats() - dump packed file, segment and compaction counts
+ */
+void pack_print_stats(FILE *out);
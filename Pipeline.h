@@ -0,0 +1,120 @@
+#pragma once
+
+#include <openssl/md5.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * GET, GETC, PUT and PUTC are one transfer pipeline, instantiated with a
+ * transfer_policy per command.  Each policy picks how one stage behaves,
+ * and a stage a command doesn't need compiles away instead of being
+ * skipped by a runtime flag: a plain GET never works out a digest.  A new
+ * command is one more typedef and one more line in the dispatch.
+ */
+
+/*
+ * md5_final_hex() - finish an MD5 that was fed a piece at a time, writing
+ *                   the NUL-terminated 32-character hex digest to hex
+ */
+inline void md5_final_hex(MD5_CTX *mdContext, char *hex)
+{
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	MD5_Final(digest, mdContext);
+	for(int i = 0; i < MD5_DIGEST_LENGTH; i++){
+		sprintf(&hex[i*2], "%02x", digest[i]);
+	}
+}
+
+/*
+ * md5_hex() - write the NUL-terminated 32-character hex MD5 digest of size
+ *             bytes of data to hex
+ */
+inline void md5_hex(const char *data, long size, char *hex)
+{
+	MD5_CTX mdContext;
+	MD5_Init(&mdContext);
+	MD5_Update(&mdContext, data, size);
+	md5_final_hex(&mdContext, hex);
+}
+
+/*
+ * Checksum policies: whether the digest travels with the body, sent after
+ * a GET's size or checked against the one a PUT carries
+ */
+struct checksum_none
+{
+	static const bool enabled = false;
+	static void reply_digest(const char *, long, char *hex) { hex[0] = '\0'; }
+	static bool verify(const char *, const char *) { return true; }
+};
+
+struct checksum_md5
+{
+	static const bool enabled = true;
+	static void reply_digest(const char *data, long size, char *hex) { md5_hex(data, size, hex); }
+	static bool verify(const char *hex, const char *claimed) { return claimed && !strncmp(hex, claimed, 2*MD5_DIGEST_LENGTH); }
+};
+
+/*
+ * Compression policies: how contents are encoded on the wire.  The protocol
+ * has no encodings yet, so identity is the only one, and costs nothing.
+ */
+struct compression_identity
+{
+	static long encode(char *contents, long size, char **wire) { *wire = contents; return size; }
+	static long decode(char *wire, long size, char **contents) { *contents = wire; return size; }
+};
+
+/*
+ * Durability policies: whether a PUT waits for the flush the server was
+ * configured with (-D) before replying
+ */
+struct durability_skip
+{
+	static const bool enabled = false;
+};
+
+struct durability_flush
+{
+	static const bool enabled = true;
+};
+
+template<typename Checksum, typename Compression, typename Durability>
+struct transfer_policy
+{
+	typedef Checksum    checksum;
+	typedef Compression compression;
+	typedef Durability  durability;
+};
+
+typedef transfer_policy<checksum_none, compression_identity, durability_skip>  get_transfer;
+typedef transfer_policy<checksum_md5,  compression_identity, durability_skip>  getc_transfer;
+typedef transfer_policy<checksum_none, compression_identity, durability_flush> put_transfer;
+typedef transfer_policy<checksum_md5,  compression_identity, durability_flush> putc_transfer;
+
+/*
+ * pipeline_prepare() - the CPU work of replying with a file read whole:
+ *                      its digest if the command sends one (hash is left
+ *                      empty otherwise), and its encoding.  Returns the
+ *                      size of what goes on the wire, and points wire at it.
+ */
+template<typename Policy>
+inline long pipeline_prepare(char *contents, long size, char *hash, char **wire)
+{
+	Policy::checksum::reply_digest(contents, size, hash);
+	return Policy::compression::encode(contents, size, wire);
+}
+
+/*
+ * pipeline_accept() - the CPU work of taking in a PUT's body: decoding it
+ *                     and working out its digest, which the index keeps for
+ *                     every file.  Returns false if the command carried a
+ *                     digest that doesn't match.
+ */
+template<typename Policy>
+inline bool pipeline_accept(char *wire, long size, const char *claimed, char *hash, char **contents, long *file_size)
+{
+	*file_size = Policy::compression::decode(wire, size, contents);
+	md5_hex(*contents, *file_size, hash);
+	return Policy::checksum::verify(hash, claimed);
+}
@@ -0,0 +1,228 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "Cache.h"
+#include "Memory.h"
+#include "Prefetch.h"
+using namespace std;
+
+#define PREFETCH_THREADS    2
+#define PREFETCH_DEPTH      4      /* a request follows each of the client's last DEPTH requests... */
+#define PREFETCH_GAP        2.0    /* ...that came at most GAP seconds before it */
+#define PREFETCH_FANOUT     8      /* successors remembered per file */
+#define PREFETCH_WINDOW     64     /* visits to a file before its counts are halved */
+#define PREFETCH_MIN_COUNT  2      /* a successor must have been seen this often... */
+#define PREFETCH_CONFIDENCE 0.5    /* ...and after this share of the file's visits */
+#define PREFETCH_FILES      65536  /* files whose successors are tracked */
+#define PREFETCH_CLIENTS    4096   /* client addresses whose recent requests are kept */
+
+/*
+ * Counts decay by halving every PREFETCH_WINDOW visits, so they reflect
+ * roughly the last window of visits rather than everything ever seen.
+ */
+struct successor
+{
+	string file_name;
+	double count;
+};
+
+struct access_pattern
+{
+	double            visits;
+	vector<successor> next;
+};
+
+struct recent_request
+{
+	string file_name;
+	double when;
+};
+
+static int budget = 0;
+
+/* prefetch_mtx protects everything below; it is only held for bookkeeping, never for I/O */
+static mutex prefetch_mtx;
+static condition_variable work_cv;
+static unordered_map<string, struct access_pattern> patterns;
+static unordered_map<in_addr_t, deque<struct recent_request> > clients;
+static deque<string> queued;
+static unordered_set<string> pending;    /* queued or being read */
+
+static atomic<long> noted(0);
+static atomic<long> learned(0);
+static atomic<long> issued(0);
+static atomic<long> over_budget(0);
+static atomic<long> loaded(0);
+static atomic<long> skipped(0);
+
+static double now_seconds(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void prefetcher(){
+	unique_lock<mutex> lock(prefetch_mtx);
+	while(1){
+		work_cv.wait(lock, []{ return !queued.empty(); });
+		string file_name = queued.front();
+		queued.pop_front();
+		lock.unlock();
+		if(cache_prefetch(file_name.c_str())){
+			loaded++;
+		}
+		else{
+			skipped++;
+		}
+		arena_reset();
+		lock.lock();
+		pending.erase(file_name);
+	}
+}
+
+/* count file_name as having followed pattern, making room among its successors if need be */
+static void count_successor(struct access_pattern *pattern, const string& file_name){
+	struct successor *weakest = NULL;
+	for(struct successor& next : pattern->next){
+		if(next.file_name == file_name){
+			next.count++;
+			return;
+		}
+		if(!weakest || next.count < weakest->count){
+			weakest = &next;
+		}
+	}
+	learned++;
+	if(pattern->next.size() < PREFETCH_FANOUT){
+		pattern->next.push_back({ file_name, 1 });
+	}
+	else{
+		*weakest = { file_name, 1 };
+	}
+}
+
+static struct access_pattern *find_pattern(const string& file_name){
+	auto it = patterns.find(file_name);
+	if(it != patterns.end()){
+		return &it->second;
+	}
+	if(patterns.size() >= PREFETCH_FILES){
+		patterns.erase(patterns.begin());
+	}
+	struct access_pattern *pattern = &patterns[file_name];
+	pattern->visits = 0;
+	return pattern;
+}
+
+static deque<struct recent_request> *find_history(in_addr_t client, double now){
+	auto it = clients.find(client);
+	if(it != clients.end()){
+		return &it->second;
+	}
+	if(clients.size() >= PREFETCH_CLIENTS){
+		for(auto stale = clients.begin(); stale != clients.end(); ){
+			stale = stale->second.back().when < now - PREFETCH_GAP ? clients.erase(stale) : next(stale);
+		}
+		if(clients.size() >= PREFETCH_CLIENTS){
+			clients.erase(clients.begin());
+		}
+	}
+	return &clients[client];
+}
+
+void prefetch_init(int max_pending){
+	budget = max_pending > 0 ? max_pending : 0;
+	if(!budget){
+		return;
+	}
+	patterns.reserve(PREFETCH_FILES);
+	for(int i = 0; i < PREFETCH_THREADS; i++){
+		thread(prefetcher).detach();
+	}
+}
+
+void prefetch_note(int connfd, const char *file_name){
+	if(!budget || !file_name){
+		return;
+	}
+	struct sockaddr_in clientaddr;
+	socklen_t clientlen = sizeof(clientaddr);
+	if(getpeername(connfd, (struct sockaddr *)&clientaddr, &clientlen) < 0){
+		return;
+	}
+	noted++;
+	double now = now_seconds();
+	string requested(file_name);
+	bool wake = false;
+
+	lock_guard<mutex> lock(prefetch_mtx);
+	deque<struct recent_request> *history = find_history(clientaddr.sin_addr.s_addr, now);
+	while(!history->empty() && history->front().when < now - PREFETCH_GAP){
+		history->pop_front();
+	}
+	for(size_t i = 0; i < history->size(); i++){
+		const string& earlier = (*history)[i].file_name;
+		bool repeated = earlier == requested;
+		for(size_t j = i + 1; j < history->size() && !repeated; j++){
+			repeated = (*history)[j].file_name == earlier;
+		}
+		/* credit each earlier file once, from its latest request */
+		if(!repeated){
+			count_successor(find_pattern(earlier), requested);
+		}
+	}
+	history->push_back({ requested, now });
+	if(history->size() > PREFETCH_DEPTH){
+		history->pop_front();
+	}
+
+	struct access_pattern *pattern = find_pattern(requested);
+	if(++pattern->visits > PREFETCH_WINDOW){
+		pattern->visits /= 2;
+		for(auto next = pattern->next.begin(); next != pattern->next.end(); ){
+			next->count /= 2;
+			next = next->count < 1 ? pattern->next.erase(next) : next + 1;
+		}
+	}
+	for(struct successor& next : pattern->next){
+		if(next.count < PREFETCH_MIN_COUNT || next.count < PREFETCH_CONFIDENCE * pattern->visits ||
+			pending.count(next.file_name)){
+			continue;
+		}
+		if((int)pending.size() >= budget){
+			over_budget++;
+			continue;
+		}
+		pending.insert(next.file_name);
+		queued.push_back(next.file_name);
+		issued++;
+		wake = true;
+	}
+	if(wake){
+		work_cv.notify_all();
+	}
+}
+
+void prefetch_print_stats(FILE *out){
+	if(!budget){
+		return;
+	}
+	prefetch_mtx.lock();
+	size_t files = patterns.size();
+	size_t in_flight = pending.size();
+	prefetch_mtx.unlock();
+	fprintf(out, "prefetch: %ld requests followed, %ld successors learned across %zu files\n",
+		noted.load(), learned.load(), files);
+	fprintf(out, "prefetch: %ld queued (%ld read into the cache, %ld already cached or unreadable, %zu pending), "
+		"%ld over the budget of %d\n", issued.load(), loaded.load(), skipped.load(), in_flight, over_budget.load(), budget);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * Clients tend to fetch files in the same groups each time, such as a
+ * manifest followed by its assets.  The prefetcher follows the order in
+ * which each client address asks for files, and counts which files came
+ * shortly after which.  When a GET names a file that the same successor has
+ * followed often enough of late, the successor is read into the cache in
+ * the background, before it is asked for.
+ */
+
+/*
+ * prefetch_init() - allow up to budget files to be waiting for or being
+ *                   prefetched at once (0 leaves prefetching off), and start
+ *                   the threads that read them
+ */
+void prefetch_init(int budget);
+
+/*
+ * prefetch_note() - record that the client on connfd asked for file_name,
+ *                   and queue the files that usually follow it
+ */
+void prefetch_note(int connfd, const char *file_name);
+
+/*
+ * prefetch_print_stats() - dump what was learned and queued
+ */
+void prefetch_print_stats(FILE *out);
@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include "Cache.h"
+#include "Restart.h"
+using namespace std;
+
+#define TAKEOVER_REQUEST "TAKEOVER\n"
+
+static bool unix_address(const char *path, struct sockaddr_un *addr){
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr->sun_path)){
+		fprintf(stderr, "Control socket path too long: %s\n", path);
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+/*
+	Send one byte of payload, with the fd riding along as SCM_RIGHTS
+*/
+static bool send_fd(int sockfd, int fd){
+	char payload = 'K';
+	struct iovec iov = { &payload, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(sockfd, &msg, 0) == 1;
+}
+
+static int receive_fd(int sockfd){
+	char payload;
+	struct iovec iov = { &payload, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if(recvmsg(sockfd, &msg, 0) != 1){
+		return -1;
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+		return -1;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* set once the listening socket is handed over; the cache follows on it */
+static atomic<int> handover_fd(-1);
+
+static void receive_cache(int controlfd){
+	int cache_fd = receive_fd(controlfd);
+	if(cache_fd >= 0){
+		cache_import(cache_fd);
+	}
+	close(controlfd);
+}
+
+int restart_takeover(const char *path){
+	struct sockaddr_un addr;
+	if(!unix_address(path, &addr)){
+		return -1;
+	}
+	int controlfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(controlfd < 0){
+		perror("Error creating control socket");
+		return -1;
+	}
+	if(connect(controlfd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		close(controlfd);
+		return -1;
+	}
+	int listenfd = -1;
+	if(write(controlfd, TAKEOVER_REQUEST, strlen(TAKEOVER_REQUEST)) != (ssize_t)strlen(TAKEOVER_REQUEST) ||
+		(listenfd = receive_fd(controlfd)) < 0){
+		fprintf(stderr, "Hot restart: no listening socket received from %s\n", path);
+		close(controlfd);
+		return -1;
+	}
+
+	/* start serving now; the old cache arrives once the old process has drained */
+	thread(receive_cache, controlfd).detach();
+	return listenfd;
+}
+
+static void control_loop(int controlfd, int listenfd){
+	while(1){
+		int connfd = accept(controlfd, NULL, NULL);
+		if(connfd < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			perror("Error accepting on control socket");
+			return;
+		}
+		char request[sizeof(TAKEOVER_REQUEST)];
+		memset(request, 0, sizeof(request));
+		if(read(connfd, request, strlen(TAKEOVER_REQUEST)) != (ssize_t)strlen(TAKEOVER_REQUEST) ||
+			strcmp(request, TAKEOVER_REQUEST)){
+			close(connfd);
+			continue;
+		}
+		if(!send_fd(connfd, listenfd)){
+			perror("Hot restart: error handing over listening socket");
+			close(connfd);
+			continue;
+		}
+
+		/*
+			The new process owns the control socket path from here on, and the
+			accept loop is told to stop and drain through the usual SIGTERM
+		*/
+		fprintf(stderr, "Hot restart: handed over to new process, draining\n");
+		handover_fd = connfd;
+		close(controlfd);
+		kill(getpid(), SIGTERM);
+		return;
+	}
+}
+
+void restart_listen(const char *path, int listenfd){
+	struct sockaddr_un addr;
+	if(!unix_address(path, &addr)){
+		return;
+	}
+	int controlfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(controlfd < 0){
+		perror("Error creating control socket");
+		return;
+	}
+	/* a previous owner of the path is either gone or has handed over to us */
+	unlink(path);
+	if(bind(controlfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(controlfd, 1) < 0){
+		perror("Error binding control socket");
+		close(controlfd);
+		return;
+	}
+	thread(control_loop, controlfd, listenfd).detach();
+}
+
+void restart_finish(){
+	int connfd = handover_fd.exchange(-1);
+	if(connfd < 0){
+		return;
+	}
+	int cache_fd = cache_export();
+	if(cache_fd >= 0){
+		send_fd(connfd, cache_fd);
+		close(cache_fd);
+	}
+	close(connfd);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+/*
+ * restart_takeover() - ask the server listening on the control socket at
+ *                      path to hand over its listening socket.  Returns the
+ *                      listening fd, or -1 if there was no server to take over
+ *                      from.  Once the old server has drained, its cache
+ *                      follows in the background.
+ */
+int restart_takeover(const char *path);
+
+/*
+ * restart_listen() - accept takeover requests on a Unix socket at path.
+ *                    After handing listenfd to a new process the server is
+ *                    sent SIGTERM, so that it stops accepting and drains.
+ */
+void restart_listen(const char *path, int listenfd);
+
+/*
+ * restart_finish() - once drained, pass the cache to the process that took
+ *                    over, if there is one
+ */
+void restart_finish();
@@ -0,0 +1,127 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <openssl/md5.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "Ring.h"
+using namespace std;
+
+static vector<struct ring_server> servers;
+
+/* (position on the ring, index of the server owning the arc ending there) */
+static vector<pair<uint64_t, int> > points;
+
+/* the first 8 bytes of the MD5, so that names spread evenly around the ring */
+static uint64_t ring_hash(const char *key, size_t key_size){
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	MD5((const unsigned char *)key, key_size, digest);
+	uint64_t position = 0;
+	for(int i = 0; i < 8; i++){
+		position = (position << 8) | digest[i];
+	}
+	return position;
+}
+
+bool ring_load(const char *path){
+	FILE *ring_file = fopen(path, "r");
+	if(!ring_file){
+		perror("Error opening ring file");
+		return false;
+	}
+	servers.clear();
+	points.clear();
+	char line[512];
+	int line_number = 0;
+	while(fgets(line, sizeof(line), ring_file)){
+		line_number++;
+		char *comment = strchr(line, '#');
+		if(comment){
+			*comment = '\0';
+		}
+		struct ring_server server;
+		server.weight = 1;
+		int fields = sscanf(line, "%255s %d %d", server.host, &server.port, &server.weight);
+		if(fields <= 0){
+			continue;
+		}
+		if(fields < 2 || server.port <= 0 || server.weight <= 0){
+			fprintf(stderr, "%s:%d: expected \"host port [weight]\"\n", path, line_number);
+			continue;
+		}
+		servers.push_back(server);
+	}
+	fclose(ring_file);
+	if(servers.empty()){
+		fprintf(stderr, "No servers in ring file %s\n", path);
+		return false;
+	}
+
+	/* a server keeps its points whatever else is in the file, so adding one only moves its share */
+	for(size_t i = 0; i < servers.size(); i++){
+		for(int v = 0; v < RING_VNODES * servers[i].weight; v++){
+			char key[300];
+			int key_size = snprintf(key, sizeof(key), "%s:%d#%d", servers[i].host, servers[i].port, v);
+			points.push_back(make_pair(ring_hash(key, key_size), (int)i));
+		}
+	}
+	sort(points.begin(), points.end());
+	return true;
+}
+
+int ring_size(){
+	return servers.size();
+}
+
+struct ring_server *ring_server(int index){
+	return &servers[index];
+}
+
+int ring_owners(const char *file_name, int replicas, int *owners){
+	if(points.empty()){
+		return 0;
+	}
+	if(replicas > (int)servers.size()){
+		replicas = servers.size();
+	}
+	uint64_t position = ring_hash(file_name, strlen(file_name));
+	size_t next = lower_bound(points.begin(), points.end(), make_pair(position, -1)) - points.begin();
+	int found = 0;
+	for(size_t step = 0; step < points.size() && found < replicas; step++){
+		int server = points[(next + step) % points.size()].second;
+		if(find(owners, owners + found, server) == owners + found){
+			owners[found++] = server;
+		}
+	}
+	return found;
+}
+
+int ring_connect(int index){
+	struct ring_server *server = &servers[index];
+	struct addrinfo hints, *addresses;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	char port[16];
+	snprintf(port, sizeof(port), "%d", server->port);
+	int err = getaddrinfo(server->host, port, &hints, &addresses);
+	if(err){
+		fprintf(stderr, "DNS error for %s: %s\n", server->host, gai_strerror(err));
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd >= 0 && connect(fd, addresses->ai_addr, addresses->ai_addrlen) < 0){
+		fprintf(stderr, "Error connecting to %s:%d: %s\n", server->host, server->port, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	return fd;
+}
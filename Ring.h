@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+ * Virtual nodes per unit of weight.  Every tool routing with the same ring
+ * file must use the same number, or they would disagree on the owners.
+ */
+#define RING_VNODES 160
+
+/*
+ * One server in the cluster.  A server with weight 2 gets twice the virtual
+ * nodes, and so about twice the files.
+ */
+struct ring_server
+{
+	char host[256];
+	int  port;
+	int  weight;
+};
+
+/*
+ * ring_load() - read the servers from path, one "host port [weight]" per
+ *               line ('#' starts a comment), and place RING_VNODES virtual
+ *               nodes per unit of weight for each on the hash ring.  Returns
+ *               false if the file can't be read or names no servers.
+ */
+bool ring_load(const char *path);
+
+/*
+ * ring_size() - number of servers on the ring
+ */
+int ring_size();
+
+/*
+ * ring_server() - the server at index, in ring-file order
+ */
+struct ring_server *ring_server(int index);
+
+/*
+ * ring_owners() - find the replicas distinct servers that own file_name,
+ *                 walking clockwise from its hash, and store their indices
+ *                 in owners.  The first one is the primary.  Returns how many
+ *                 were found, which is fewer if the ring is smaller.
+ */
+int ring_owners(const char *file_name, int replicas, int *owners);
+
+/*
+ * ring_connect() - open a connection to the server at index.  Unlike
+ *                  connect_to_server() a dead server isn't fatal: returns -1
+ *                  so that the caller can try another replica.
+ */
+int ring_connect(int index);
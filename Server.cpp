@@ -13,13 +13,98 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
 #include "support.h"
 #include "Server.h"
+#include "Admission.h"
+#include "Durability.h"
+#include "LargeIO.h"
+#include "Cache.h"
+#include "Restart.h"
+#include "Index.h"
+#include "Upstream.h"
+#include "Memory.h"
+#include "Trace.h"
+#include "Async.h"
+#include "Pack.h"
+#include "Prefetch.h"
+#include "Pipeline.h"
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <string>
 using namespace std;
 mutex server_mtx;
 
+/* Seconds a connection may sit idle mid-request before a worker gives up on it */
+#define IDLE_TIMEOUT 10
+
+/* Seconds a shutting-down server waits for its active transfers */
+#define DRAIN_TIMEOUT 30
+
+/* Where the LRU cache's file names are saved for the next start */
+#define CACHE_SNAPSHOT ".lru_snapshot"
+
+/* Where SIGUSR2 writes the trace rings */
+#define TRACE_DUMP ".trace"
+
+/* GETs answered NOTMODIFIED, and the body bytes that didn't have to be sent */
+static atomic<long> not_modified_count(0);
+static atomic<long> not_modified_bytes(0);
+
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t shutdown_requested = 0;
+static volatile sig_atomic_t trace_requested = 0;
+
+static void request_stats(int sig){
+	stats_requested = 1;
+}
+
+static void request_shutdown(int sig){
+	shutdown_requested = 1;
+}
+
+static void request_trace(int sig){
+	trace_requested = 1;
+}
+
+/*
+	Helper threads are started with these signals blocked, so that they are
+	always delivered to the accept loop and interrupt accept()
+*/
+static void block_server_signals(int how){
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	pthread_sigmask(how, &signals, NULL);
+}
+
+static void snapshot_periodically(int interval){
+	while(1){
+		sleep(interval);
+		cache_save_snapshot(CACHE_SNAPSHOT);
+	}
+}
+
+static void print_stats(){
+	admission_print_stats(stderr);
+	durability_print_stats(stderr);
+	large_io_print_stats(stderr);
+	cache_print_stats(stderr);
+	memory_print_stats(stderr);
+	trace_print_stats(stderr);
+	upstream_print_stats(stderr);
+	async_print_stats(stderr);
+	pack_print_stats(stderr);
+	prefetch_print_stats(stderr);
+	fprintf(stderr, "conditional get: %ld not modified, %ld bytes not sent\n", not_modified_count.load(),
+		not_modified_bytes.load());
+}
+
 void help(char *progname)
 {
 	printf("Usage: %s [OPTIONS]\n", progname);
@@ -27,6 +112,30 @@ void help(char *progname)
 	printf("  -m    enable multithreading mode\n");
 	printf("  -l    number of entries in the LRU cache\n");
 	printf("  -p    port on which to listen for connections\n");
+	printf("  -C    maximum concurrent connections in multithreading or async mode\n");
+	printf("  -q    connections that may wait for a worker before being shed\n");
+	printf("  -d    milliseconds a connection may wait before being shed\n");
+	printf("  -r    per-client requests per second (0 = unlimited)\n");
+	printf("  -b    per-client bytes per second (0 = unlimited)\n");
+	printf("  -D    make PUTs durable before replying: syncfs or fdatasync\n");
+	printf("  -W    microseconds a durable commit window stays open\n");
+	printf("  -B    maximum PUTs flushed in one commit window\n");
+	printf("  -T    files of at least this many bytes bypass the page cache\n");
+	printf("  -A    aligned 1MB blocks available to large-file transfers\n");
+	printf("  -s    seconds between cache snapshots (0 = only on shutdown)\n");
+	printf("  -w    threads warming the cache from the last snapshot\n");
+	printf("  -U    Unix socket on which to accept hot-restart takeovers\n");
+	printf("  -H    take over the listening socket of the server at -U\n");
+	printf("  -i    threads hashing files for the metadata index at startup\n");
+	printf("  -n    missing file names remembered (0 = never remember)\n");
+	printf("  -N    milliseconds a missing file name is remembered\n");
+	printf("  -u    host:port of a server to fetch files missing here from\n");
+	printf("  -t    events kept per thread for tracing (0 = tracing off)\n");
+	printf("  -a    event loop threads serving GET and PUT as coroutines (0 = off)\n");
+	printf("  -o    threads running the event loops' blocking file operations\n");
+	printf("  -k    pack files of at most this many bytes into segments (0 = off)\n");
+	printf("  -P    files that may be waiting to be prefetched into the cache (0 = off)\n");
+	printf("Send SIGUSR1 to print statistics, SIGUSR2 to dump traces to %s, SIGTERM or SIGINT to shut down\n", TRACE_DUMP);
 }
 
 void die(const char *msg1, char *msg2)
@@ -80,12 +189,17 @@ int open_server_socket(int port)
 /*
  * handle_requests() - given a listening file descriptor, continually wait
  *                     for a request to come in, and when it arrives, pass it
- *                     to service_function.  Note that this is not a
- *                     multi-threaded server.
+ *                     through admission control to service_function.  In
+ *                     multithreading mode a fixed pool of workers serves the
+ *                     admitted connections, and in async mode the event loops
+ *                     do.  Returns once asked to shut down.
  */
-void handle_requests(int listenfd, void (*service_function)(int, int), int param, bool multithread)
+void handle_requests(int listenfd, void (*service_function)(int, int), int param, bool multithread,
+	struct admission_config *limits)
 {
-	while(1)
+	admission_init(limits, service_function, param, multithread);
+	block_server_signals(SIG_UNBLOCK);
+	while(!shutdown_requested)
 	{
 		/* block until we get a connection */
 		struct sockaddr_in clientaddr;
@@ -94,6 +208,24 @@ void handle_requests(int listenfd, void (*service_function)(int, int), int param
 		int connfd;
 		if((connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen)) < 0)
 		{
+			if(errno == EINTR)
+			{
+				if(shutdown_requested)
+				{
+					break;
+				}
+				if(stats_requested)
+				{
+					stats_requested = 0;
+					print_stats();
+				}
+				if(trace_requested)
+				{
+					trace_requested = 0;
+					trace_dump(TRACE_DUMP);
+				}
+				continue;
+			}
 			die("Error in accept(): ", strerror(errno));
 		}
 
@@ -108,180 +240,704 @@ void handle_requests(int listenfd, void (*service_function)(int, int), int param
 		char *haddrp = inet_ntoa(clientaddr.sin_addr);
 		printf("server connected to %s (%s)\n", hp->h_name, haddrp);
 
+		/* don't let a stalled client hold on to a worker forever */
+		struct timeval timeout = { IDLE_TIMEOUT, 0 };
+		setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
 		/* serve requests */
-		if(multithread){
-			if(!fork()){
-				service_function(connfd, param);
-      }
-			if(close(connfd) < 0){
-				die("Error in close(): ", strerror(errno));
+		if(admission_admit(connfd, clientaddr.sin_addr.s_addr)){
+			if(async_enabled()){
+				async_submit(connfd);
 			}
-		}
-		else{
-			service_function(connfd, param);
-			/* clean up, await new connection */
-			if(close(connfd) < 0)
-			{
-				die("Error in close(): ", strerror(errno));
+			else{
+				admission_submit(connfd);
 			}
 		}
 	}
 }
 
-char* hash_MD5(char* file_contents){
-	unsigned char digest[MD5_DIGEST_LENGTH];
-	MD5_CTX mdContext;
-	MD5_Init(&mdContext);
-	MD5_Update(&mdContext, file_contents, strlen(file_contents));
-	MD5_Final (digest ,&mdContext);
+char* hash_MD5(char* file_contents, long int file_size){
+	char* hashed_string = (char *)arena_alloc((2*MD5_DIGEST_LENGTH+1)*sizeof(char));
+	trace_begin(TRACE_HASH);
+	md5_hex(file_contents, file_size, hashed_string);
+	trace_end(TRACE_HASH);
+	return hashed_string;
+}
 
-	char* hashed_string = (char *)malloc(2*MD5_DIGEST_LENGTH*sizeof(char));
-	bzero(hashed_string, MD5_DIGEST_LENGTH);
-	for(int i = 0; i < MD5_DIGEST_LENGTH; i++){
-		sprintf(&hashed_string[i*2], "%02x", digest[i]);
+/*
+	Each connection has its own socket, so none of the write_* helpers need
+	server_mtx - holding it across a write to a slow client would stall every
+	other worker behind that client.
+*/
+bool write_error(int connfd, int err){
+	char error_response[256];
+	int error_response_size = snprintf(error_response, sizeof(error_response), "ERROR (%d): %s\n", err, strerror(err));
+	if(write(connfd, error_response, error_response_size) < 0){
+		fprintf(stderr, "%s", "Error writing error response\n");
+		return false;
 	}
-	return hashed_string;
+	return true;
 }
 
 bool write_OK(int connfd, char* file_name){
-	server_mtx.lock();
 	int OK_response_size = 3 + strlen(file_name) + 1;
-	char OK_response[OK_response_size];
+	char OK_response[OK_response_size + 1];
 	sprintf(OK_response, "OK %s\n", file_name);
 	if(write(connfd, OK_response, OK_response_size) < 0){
 		fprintf(stderr, "%s", "Error writing OK\n");
-		server_mtx.unlock();
 		return false;
 	}
-	server_mtx.unlock();
 	return true;
 }
 
 bool write_size(int connfd, long int file_size){
-	server_mtx.lock();
 	if(write(connfd, &file_size, sizeof(file_size)) < 0){
 		fprintf(stderr, "%s", "Error writing file size\n");
-		server_mtx.unlock();
 		return false;
 	}
-	server_mtx.unlock();
 	return true;
 }
 
 bool write_hash(int connfd, char* hashed_file){
-	server_mtx.lock();
 	if(write(connfd, hashed_file, 32) < 0){
 		fprintf(stderr, "%s", "Error writing file hash\n");
-		server_mtx.unlock();
 		return false;
 	}
-	server_mtx.unlock();
 	return true;
 }
 
 bool write_file(int connfd, char* file, long file_size){
-	server_mtx.lock();
-	if(write(connfd, file, file_size) < 0){
-		fprintf(stderr, "%s", "Error writing file contents\n");
-		server_mtx.unlock();
-		return false;
+	/* a socket with a send timeout can come back with a short count */
+	trace_begin(TRACE_SEND);
+	long int written = 0;
+	while(written < file_size){
+		long int count = write(connfd, file + written, file_size - written);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			trace_end(TRACE_SEND);
+			fprintf(stderr, "%s", "Error writing file contents\n");
+			return false;
+		}
+		written += count;
 	}
-	server_mtx.unlock();
+	trace_end(TRACE_SEND);
+	admission_charge(connfd, file_size);
 	return true;
 }
 
+/*
+	The flush happens after the caller has dropped server_mtx, so that PUTs
+	running concurrently can share one commit window.  Returns 0, or the
+	errno of whatever failed.
+*/
+template<typename Durability>
+int flush_put(char* file_name, FILE* put_file){
+	int err = 0;
+	if(fflush(put_file) != 0){
+		err = errno;
+	}
+	else if constexpr (Durability::enabled){
+		trace_begin(TRACE_FLUSH);
+		err = durability_commit(fileno(put_file), file_name);
+		trace_end(TRACE_FLUSH);
+	}
+	if(fclose(put_file) != 0 && !err){
+		err = errno;
+	}
+	if(err){
+		fprintf(stderr, "PUT - Error flushing %s: %s\n", file_name, strerror(err));
+	}
+	return err;
+}
+
+/*
+ * store_put() - write a PUT's contents, from fopen() through the durable
+ *               flush, and take ownership of file_contents.  Small enough
+ *               files are packed into a segment instead.  The digest is
+ *               checked before anything is opened, so a corrupt upload
+ *               never truncates the file it was meant to replace.
+ *               Returns 0, or an errno value.
+ */
+template<typename Policy>
+int store_put(char* file_name, long int file_size, char* file_contents, char* MD5_digest){
+	char hash[2*MD5_DIGEST_LENGTH+1];
+	trace_begin(TRACE_HASH);
+	bool verified = pipeline_accept<Policy>(file_contents, file_size, MD5_digest, hash, &file_contents, &file_size);
+	trace_end(TRACE_HASH);
+	if(!verified){
+		perror("MD5 does not match");
+		slab_free(file_contents);
+		return EBADMSG;
+	}
+	/* pack_wanted() may wait for the log to be recovered, which mustn't hold up everyone else */
+	bool packed = pack_wanted(file_size);
+	trace_lock(server_mtx, TRACE_WAIT_SERVER_MTX);
+	FILE* put_file = NULL;
+	bool unpacked = false;
+	if(packed){
+		int err = pack_put(file_name, file_contents, file_size, hash);
+		if(err){
+			trace_unlock(server_mtx, TRACE_WAIT_SERVER_MTX);
+			slab_free(file_contents);
+			return err;
+		}
+	}
+	else{
+		/* a packed copy would be read before this file, so it goes before the file is touched */
+		int err = pack_remove(file_name, &unpacked);
+		if(!err){
+			put_file = fopen(file_name, "wb");
+			if(!put_file){
+				err = errno;
+				perror("Error opening file for writing");
+			}
+		}
+		if(err){
+			trace_unlock(server_mtx, TRACE_WAIT_SERVER_MTX);
+			slab_free(file_contents);
+			return err;
+		}
+		trace_begin(TRACE_DISK_WRITE);
+		fwrite(file_contents, file_size, 1, put_file);
+		trace_end(TRACE_DISK_WRITE);
+	}
+	cache_forget_missing(file_name);
+	cache_insert(file_name, file_size, hash, file_contents);
+	index_update(file_name, file_size, hash);
+	trace_unlock(server_mtx, TRACE_WAIT_SERVER_MTX);
+	if(!put_file){
+		/* a file of its own by this name goes only once the packed copy can't be lost */
+		int err = Policy::durability::enabled ? pack_commit() : 0;
+		if(!err){
+			pack_unshadow(file_name);
+		}
+		return err;
+	}
+	int err = flush_put<typename Policy::durability>(file_name, put_file);
+	if(!err && unpacked && Policy::durability::enabled){
+		err = pack_commit();
+	}
+	return err;
+}
+
+/*
+	Files over the large-file threshold are streamed through aligned blocks
+	instead of being read whole, and never enter the LRU cache, so that they
+	don't push the small hot files out of memory
+*/
+template<typename Policy>
+bool get_large(int connfd, char* file_name, long int file_size){
+	int fd = large_open(file_name, O_RDONLY);
+	if(fd < 0){
+		int err = errno;
+		fprintf(stderr, "GET - Error opening %s: %s\n", file_name, strerror(err));
+		write_error(connfd, err);
+		return false;
+	}
+	char hashed_file[2*MD5_DIGEST_LENGTH+1];
+	trace_begin(TRACE_HASH);
+	bool hashed = !Policy::checksum::enabled || large_digest(fd, file_size, hashed_file);
+	trace_end(TRACE_HASH);
+	if(!hashed){
+		close(fd);
+		write_error(connfd, EIO);
+		return false;
+	}
+	bool sent = write_OK(connfd, file_name) && write_size(connfd, file_size) &&
+		(!Policy::checksum::enabled || write_hash(connfd, hashed_file));
+	if(sent){
+		/* reading the disk and sending are interleaved block by block */
+		trace_begin(TRACE_SEND);
+		sent = large_send(connfd, fd, file_size);
+		trace_end(TRACE_SEND);
+	}
+	if(sent){
+		admission_charge(connfd, file_size);
+	}
+	close(fd);
+	return sent;
+}
+
+void temp_path(const char* file_name, const char* purpose, char* path, size_t size){
+	static atomic<long> made(0);
+	const char* slash = strrchr(file_name, '/');
+	int directory_size = slash ? slash - file_name + 1 : 0;
+	char name_digest[2*MD5_DIGEST_LENGTH+1];
+	md5_hex(file_name, strlen(file_name), name_digest);
+	snprintf(path, size, "%.*s.%s.%s.%d.%ld", directory_size, file_name, purpose, name_digest, (int)getpid(), made++);
+}
+
+/*
+	Rename a complete upload over file_name, taking the place of any packed
+	copy at the same moment.  With durable PUTs the rename is flushed too,
+	through the same commit windows as the contents were, and only then is
+	the packed copy's tombstone.  Returns 0, or an errno value.
+*/
+template<typename Durability>
+int install_put(const char* temp_name, const char* file_name){
+	bool unpacked;
+	/* under server_mtx, so an upstream fetch can't slip its older copy in behind it */
+	trace_lock(server_mtx, TRACE_WAIT_SERVER_MTX);
+	int err = pack_install(temp_name, file_name, &unpacked);
+	trace_unlock(server_mtx, TRACE_WAIT_SERVER_MTX);
+	if(err){
+		return err;
+	}
+	if constexpr (Durability::enabled){
+		if(!durability_enabled()){
+			return 0;
+		}
+		const char* slash = strrchr(file_name, '/');
+		string directory = slash ? string(file_name, slash - file_name + 1) : string(".");
+		int dirfd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+		if(dirfd < 0){
+			return errno;
+		}
+		trace_begin(TRACE_FLUSH);
+		err = durability_commit(dirfd, NULL);
+		trace_end(TRACE_FLUSH);
+		close(dirfd);
+		if(!err && unpacked){
+			err = pack_commit();
+		}
+		return err;
+	}
+	return 0;
+}
+
+/*
+	A large upload goes to a temporary file, and only replaces file_name
+	once it is complete, matches its digest and has been flushed, so a
+	failed or abandoned upload leaves the previous copy alone
+*/
+template<typename Policy>
+bool put_large(int connfd, char* file_name, long int file_size, char* body, long int body_in_buffer, char* MD5_digest){
+	char temp_name[strlen(file_name) + 128];
+	temp_path(file_name, "put", temp_name, sizeof(temp_name));
+	int fd = large_open(temp_name, O_WRONLY | O_CREAT | O_EXCL);
+	if(fd < 0){
+		int err = errno;
+		perror("Error opening file for writing");
+		write_error(connfd, err);
+		return false;
+	}
+	/* the digest is always worked out on the way through, for the index */
+	MD5_CTX mdContext;
+	MD5_Init(&mdContext);
+	char hash[2*MD5_DIGEST_LENGTH+1];
+	trace_begin(TRACE_RECV);
+	int err = large_receive(connfd, fd, file_size, body, body_in_buffer, &mdContext);
+	trace_end(TRACE_RECV);
+	if(!err){
+		md5_final_hex(&mdContext, hash);
+		if(!Policy::checksum::verify(hash, MD5_digest)){
+			perror("MD5 does not match");
+			err = EBADMSG;
+		}
+	}
+	if(!err && Policy::durability::enabled){
+		trace_begin(TRACE_FLUSH);
+		err = durability_commit(fd, NULL);
+		trace_end(TRACE_FLUSH);
+	}
+	if(close(fd) < 0 && !err){
+		err = errno;
+	}
+	if(!err){
+		err = install_put<typename Policy::durability>(temp_name, file_name);
+	}
+	if(err){
+		unlink(temp_name);
+		write_error(connfd, err);
+		return false;
+	}
+	cache_forget_missing(file_name);
+	cache_remove(file_name);
+	index_update(file_name, file_size, hash);
+	admission_charge(connfd, file_size);
+	return write_OK(connfd, file_name);
+}
+
+/*
+ * read_body() - gather a PUT's file_size bytes of contents, starting with
+ *               whatever arrived in the same read as the request line.
+ *               Returns a NUL-terminated copy, or NULL if the client hung up.
+ */
+char* read_body(int connfd, char* body, long int body_in_buffer, long int file_size){
+	char* file_contents = slab_alloc((file_size+1)*sizeof(char));
+	if(!file_contents){
+		return NULL;
+	}
+	long int received = body_in_buffer < file_size ? body_in_buffer : file_size;
+	memcpy(file_contents, body, received);
+	trace_begin(TRACE_RECV);
+	while(received < file_size){
+		long int count = read(connfd, file_contents + received, file_size - received);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			trace_end(TRACE_RECV);
+			slab_free(file_contents);
+			return NULL;
+		}
+		received += count;
+	}
+	trace_end(TRACE_RECV);
+	file_contents[file_size] = '\0';
+	return file_contents;
+}
+
 long int read_file_size(FILE* file){
-	server_mtx.lock();
+	trace_lock(server_mtx, TRACE_WAIT_SERVER_MTX);
 	fseek(file, 0, SEEK_END);
 	long int file_size = ftell(file);
 	fseek(file, 0, SEEK_SET);
-	server_mtx.unlock();
+	trace_unlock(server_mtx, TRACE_WAIT_SERVER_MTX);
 	return file_size;
 }
 
 
-bool get_cached(int connfd, char* file_name, char** LRU, char** LRU_file_names, long int* LRU_file_sizes, char** LRU_hashes, int lru_size, bool checksum){
-		for(int i = 0; i < lru_size; i++){
-			if(LRU_file_names[i]){
-				if(!strncmp(LRU_file_names[i], file_name, strlen(file_name))){
-					if(write_OK(connfd, file_name)){
-						if(write_size(connfd, LRU_file_sizes[i])){
-							if(checksum){
-								if(write_hash(connfd, LRU_hashes[i])){
-									if(write_file(connfd, LRU[i], LRU_file_sizes[i])){
-										printf("Cached\n");
-										return true;
-									}
-								}
-							}
-							else{
-								if(write_file(connfd, LRU[i], LRU_file_sizes[i])){
-									printf("Cached\n");
-									return true;
-								}
-							}
-						}
-					}
-				}
-			}
+/*
+	A cache hit is copied out under cache_mtx and sent without it, so a slow
+	client never holds up everyone else waiting on the cache.  Returns the
+	copy, with its size, digest (empty if no GETC has needed it yet) and
+	the entry's filled stamp, or NULL on a miss.
+*/
+static char* copy_cached(char* file_name, long int* file_size, char* hash, unsigned long* filled){
+	char* contents = NULL;
+	trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	trace_begin(TRACE_CACHE_LOOKUP);
+	struct cache_entry *entry = cache_lookup(file_name);
+	trace_end(TRACE_CACHE_LOOKUP);
+	if(entry){
+		contents = slab_alloc(entry->file_size + 1);
+	}
+	if(contents){
+		*file_size = entry->file_size;
+		memcpy(contents, entry->contents, entry->file_size + 1);
+		strcpy(hash, entry->hash);
+		*filled = entry->filled;
+	}
+	trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+	return contents;
+}
+
+/*
+	A plain GET caches no digest, so the first GETC of such an entry works
+	it out and keeps it.  Returns true if the file was cached.
+*/
+template<typename Policy>
+bool get_cached(int connfd, char* file_name){
+	long int file_size;
+	char hash[2*MD5_DIGEST_LENGTH+1];
+	unsigned long filled;
+	char* contents = copy_cached(file_name, &file_size, hash, &filled);
+	if(!contents){
+		return false;
+	}
+	if(Policy::checksum::enabled && !hash[0]){
+		trace_begin(TRACE_HASH);
+		Policy::checksum::reply_digest(contents, file_size, hash);
+		trace_end(TRACE_HASH);
+		cache_note_digest(file_name, filled, hash);
+	}
+	char* wire;
+	long int wire_size = Policy::compression::encode(contents, file_size, &wire);
+	if(write_OK(connfd, file_name) && write_size(connfd, wire_size) &&
+		(!Policy::checksum::enabled || write_hash(connfd, hash)) && write_file(connfd, wire, wire_size)){
+		printf("Cached\n");
+	}
+	slab_free(contents);
+	return true;
+}
+
+/*
+	A packed file is read with one pread from its open segment, and then
+	kept in the LRU cache like any other small file.  Returns true if the
+	file was packed.
+*/
+template<typename Policy>
+bool get_packed(int connfd, char* file_name){
+	long int file_size;
+	char hashed_file[2*MD5_DIGEST_LENGTH+1];
+	char* file_buffer = pack_read(file_name, &file_size, hashed_file);
+	if(!file_buffer){
+		return false;
+	}
+	char* wire;
+	long int wire_size = Policy::compression::encode(file_buffer, file_size, &wire);
+	if(write_OK(connfd, file_name) && write_size(connfd, wire_size) &&
+		(!Policy::checksum::enabled || write_hash(connfd, hashed_file))){
+		write_file(connfd, wire, wire_size);
+	}
+	cache_insert(file_name, file_size, hashed_file, file_buffer);
+	return true;
+}
+
+/*
+	A file missing here is streamed from the upstream server as it arrives,
+	while it is also written to disk and the cache.  Concurrent misses for
+	the same file all follow one fetch.  Returns 0 once a reply has been
+	sent, or the errno to report if nothing could be.
+*/
+template<typename Policy>
+int get_upstream(int connfd, char* file_name, unsigned long generation){
+	trace_begin(TRACE_UPSTREAM);
+	struct upstream_fetch *fetch = upstream_join(file_name, generation);
+	long int file_size;
+	char hashed_file[2*MD5_DIGEST_LENGTH+1];
+	int err = upstream_wait_header(fetch, &file_size, hashed_file);
+	trace_end(TRACE_UPSTREAM);
+	if(err){
+		upstream_leave(fetch);
+		return err;
+	}
+	bool sent = write_OK(connfd, file_name) && write_size(connfd, file_size) &&
+		(!Policy::checksum::enabled || write_hash(connfd, hashed_file));
+	const long int block_size = 64 * 1024;
+	char* block = (char*)arena_alloc(block_size);
+	long int offset = 0;
+	while(sent && offset < file_size){
+		/* if the upstream fails part way, the client is left with a short body */
+		long int count = upstream_read(fetch, offset, block, block_size);
+		if(count <= 0){
+			break;
 		}
-	return false;
-}
-
-bool put_cached(char* file_name, char** LRU, char** LRU_file_names, long int* LRU_file_sizes,
-	char** LRU_hashes, int lru_size, bool checksum, long int file_size, char* hash,
-	char* file_buffer, FILE* file){
-		for(int i = 0; i < lru_size; i++){
-			if(LRU_file_names[i]){
-				if(!strncmp(LRU_file_names[i], file_name, strlen(file_name))){
-						if(file_size == LRU_file_sizes[i]){
-							if(checksum){
-								if(!strncmp(LRU_hashes[i], hash, strlen(LRU_hashes[i]))){
-									if(!strncmp(LRU[i], file_buffer, strlen(LRU[i]))){
-										printf("Cached\n");
-										return true;
-									}
-									else{
-										sprintf(LRU_file_names[i], "%s", (file_name));
-										LRU_file_sizes[i] = file_size;
-										LRU_hashes[i] = hash;
-										LRU[i] = file_buffer;
-										return true;
-									}
-								}
-								else{
-									sprintf(LRU_file_names[i], "%s", (file_name));
-									LRU_file_sizes[i] = file_size;
-									LRU_hashes[i] = hash;
-									LRU[i] = file_buffer;
-									return true;
-								}
-							}
-							else{
-								if(!strncmp(LRU[i], file_buffer, strlen(LRU[i]))){
-									printf("Cached\n");
-									return true;
-								}
-								else{
-									sprintf(LRU_file_names[i], "%s", (file_name));
-									LRU_file_sizes[i] = file_size;
-									LRU_hashes[i] = hash;
-									LRU[i] = file_buffer;
-									return true;
-								}
-							}
-						}
-						else{
-							sprintf(LRU_file_names[i], "%s", (file_name));
-							LRU_file_sizes[i] = file_size;
-							LRU_hashes[i] = hash;
-							LRU[i] = file_buffer;
-							return true;
-						}
-					}
-				}
-			}
-	return false;
+		sent = write_file(connfd, block, count);
+		offset += count;
+	}
+	upstream_leave(fetch);
+	return 0;
+}
+
+/*
+	A file that isn't there is remembered for a moment, so clients polling
+	for it don't each cost an fopen()
+*/
+void get_failed(int connfd, char* file_name, int err, unsigned long generation){
+	fprintf(stderr, "GET - Error opening %s: %s\n", file_name, strerror(err));
+	if(err == ENOENT){
+		cache_note_missing(file_name, generation);
+	}
+	write_error(connfd, err);
+}
+
+/*
+	A GET or GETC may carry "IF-DIGEST <md5>" and/or "IF-MODIFIED <mtime>"
+	lines after the file name, describing the copy the client already has
+*/
+struct get_conditions
+{
+	char     digest[2*MD5_DIGEST_LENGTH+1];
+	long int mtime;
+};
+
+/*
+ * parse_conditions() - read the lines following a GET's file name.  Returns
+ *                      false if the request carried no condition.
+ */
+bool parse_conditions(char* lines, char* end, struct get_conditions* conditions){
+	conditions->digest[0] = '\0';
+	conditions->mtime = -1;
+	while(lines < end && *lines){
+		char* line_end = (char*)memchr(lines, '\n', end - lines);
+		if(!line_end){
+			break;
+		}
+		*line_end = '\0';
+		if(!strncmp(lines, "IF-DIGEST ", 10) && strlen(lines + 10) == 2*MD5_DIGEST_LENGTH){
+			strcpy(conditions->digest, lines + 10);
+		}
+		else if(!strncmp(lines, "IF-MODIFIED ", 12)){
+			conditions->mtime = atol(lines + 12);
+		}
+		lines = line_end + 1;
+	}
+	return conditions->digest[0] || conditions->mtime >= 0;
+}
+
+/*
+	Only what is already in memory is consulted - the cached entry's hash, or
+	the index - so deciding never costs a file read.  If neither knows the
+	digest yet the answer is "modified", and the client gets the whole file.
+*/
+bool not_modified(char* file_name, struct get_conditions* conditions){
+	struct file_meta meta;
+	bool indexed = index_lookup(file_name, &meta);
+	if(!indexed){
+		return false;
+	}
+	if(conditions->mtime >= 0 && meta.mtime > conditions->mtime){
+		return false;
+	}
+	if(conditions->digest[0]){
+		trace_lock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+		struct cache_entry *entry = cache_lookup(file_name);
+		if(entry && entry->hash[0]){
+			strcpy(meta.digest, entry->hash);
+		}
+		trace_unlock(cache_mtx, TRACE_WAIT_CACHE_MTX);
+		if(strncmp(meta.digest, conditions->digest, 2*MD5_DIGEST_LENGTH)){
+			return false;
+		}
+	}
+	not_modified_count++;
+	not_modified_bytes += meta.file_size;
+	return true;
+}
+
+bool write_not_modified(int connfd, char* file_name){
+	int response_size = 12 + strlen(file_name) + 1;
+	char response[response_size + 1];
+	sprintf(response, "NOTMODIFIED %s\n", file_name);
+	if(write(connfd, response, response_size) < 0){
+		fprintf(stderr, "%s", "Error writing NOTMODIFIED\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+	STAT replies "OK name" and then "<size> <mtime> <digest>", from the index
+	alone, so no file is opened.  The digest is "-" until it has been hashed.
+*/
+bool stat_file(int connfd, char* file_name){
+	struct file_meta meta;
+	if(cache_missing(file_name) || !index_lookup(file_name, &meta)){
+		return write_error(connfd, ENOENT);
+	}
+	char stat_response[128];
+	int stat_response_size = snprintf(stat_response, sizeof(stat_response), "%ld %ld %s\n", meta.file_size,
+		(long)meta.mtime, meta.digest[0] ? meta.digest : "-");
+	if(!write_OK(connfd, file_name) || write(connfd, stat_response, stat_response_size) < 0){
+		fprintf(stderr, "%s", "Error writing file metadata\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * serve_get() - answer a GET or GETC, whose file name starts at request, from
+ *               the cache, a segment, the disk or the upstream server, in
+ *               that order
+ */
+template<typename Policy>
+static void serve_get(int connfd, char* request, char* end){
+	trace_begin(TRACE_PARSE);
+	char* file_name = strtok(request, "\n");
+	struct get_conditions conditions;
+	bool conditional = file_name && parse_conditions(file_name + strlen(file_name) + 1, end, &conditions);
+	trace_end(TRACE_PARSE);
+	if(!file_name){
+		write_error(connfd, EINVAL);
+		return;
+	}
+	prefetch_note(connfd, file_name);
+
+	if(cache_missing(file_name)){
+		write_error(connfd, ENOENT);
+		return;
+	}
+	if(conditional && not_modified(file_name, &conditions)){
+		write_not_modified(connfd, file_name);
+		return;
+	}
+	/* read before the cache and the pack are tried, so a PUT that packs the file meanwhile is noticed */
+	unsigned long generation = cache_missing_generation();
+	if(get_cached<Policy>(connfd, file_name) || get_packed<Policy>(connfd, file_name)){
+		return;
+	}
+	FILE* get_file = fopen(file_name, "rb");
+	if(!get_file){
+		int err = errno;
+		if(err == ENOENT && upstream_enabled()){
+			err = get_upstream<Policy>(connfd, file_name, generation);
+		}
+		if(err){
+			get_failed(connfd, file_name, err, generation);
+		}
+		return;
+	}
+	long int file_size = read_file_size(get_file);
+	if(large_io_wanted(file_size)){
+		get_large<Policy>(connfd, file_name, file_size);
+		fclose(get_file);
+		return;
+	}
+	char* file_buffer = slab_alloc(sizeof(char)*(file_size+1));
+	if(!file_buffer){
+		fclose(get_file);
+		write_error(connfd, ENOMEM);
+		return;
+	}
+	write_OK(connfd, file_name);
+
+	trace_begin(TRACE_DISK_READ);
+	fread(file_buffer, file_size, 1, get_file);
+	trace_end(TRACE_DISK_READ);
+	fclose(get_file);
+	file_buffer[file_size] = '\0';
+
+	/* only GETC pays for a digest; a plain GET caches the file without one */
+	char hashed_file[2*MD5_DIGEST_LENGTH+1];
+	char* wire;
+	trace_begin(TRACE_HASH);
+	long int wire_size = pipeline_prepare<Policy>(file_buffer, file_size, hashed_file, &wire);
+	trace_end(TRACE_HASH);
+	write_size(connfd, wire_size);
+	if(Policy::checksum::enabled){
+		write_hash(connfd, hashed_file);
+	}
+	write_file(connfd, wire, wire_size);
+	cache_insert(file_name, file_size, hashed_file, file_buffer);
+}
+
+/*
+ * serve_put() - take a PUT or PUTC, whose file name starts at request.  The
+ *               size follows on the next line, and for PUTC the digest on
+ *               the one after, then the body.
+ */
+template<typename Policy>
+static void serve_put(int connfd, char* request, char* end){
+	char* saveptr;
+	trace_begin(TRACE_PARSE);
+	char* file_name = strtok_r(request, "\n", &saveptr);
+	char* file_size_string = file_name ? strtok_r(NULL, "\n", &saveptr) : NULL;
+	char* MD5_digest = NULL;
+	if(Policy::checksum::enabled && file_size_string){
+		MD5_digest = strtok_r(NULL, "\n", &saveptr);
+	}
+	long int file_size = file_size_string ? atol(file_size_string) : -1;
+	trace_end(TRACE_PARSE);
+	if(file_size < 0 || (Policy::checksum::enabled && (!MD5_digest || strlen(MD5_digest) != 2*MD5_DIGEST_LENGTH))){
+		write_error(connfd, EINVAL);
+		return;
+	}
+	char* last = Policy::checksum::enabled ? MD5_digest : file_size_string;
+	char* body = last + strlen(last) + 1;
+	long int body_in_buffer = body < end ? end - body : 0;
+	if(large_io_wanted(file_size)){
+		put_large<Policy>(connfd, file_name, file_size, body, body_in_buffer, MD5_digest);
+		return;
+	}
+
+	/* the rest of the body is read before taking server_mtx */
+	char* file_contents = read_body(connfd, body, body_in_buffer, file_size);
+	if(!file_contents){
+		write_error(connfd, EPIPE);
+		return;
+	}
+	int err = store_put<Policy>(file_name, file_size, file_contents, MD5_digest);
+	if(err){
+		write_error(connfd, err);
+	}
+	else{
+		write_OK(connfd, file_name);
+	}
 }
 
 /*
@@ -293,248 +949,440 @@ void file_server(int connfd, int lru_size)
 
 		const int MAXLINE = 8192;
 
-		/* LRU Cache */
-		/*
-			Acts as a circular buffer
-		*/
-
-		static char **LRU = (char**)malloc(sizeof(char *)*lru_size);
-		static char **LRU_file_names = (char**)malloc(sizeof(char *)*lru_size);
-		static long int* LRU_file_sizes = (long int*)malloc(sizeof(long int)*lru_size);
-		static char** LRU_hashes = (char**)malloc(sizeof(char *)*lru_size);
-	 	static int lru_index = 0;
-		static bool lru_initialized = false;
-		static mutex cache_mtx;
-
-		if(!lru_initialized){
-			cache_mtx.lock();
-			for(int i = 0; i < lru_size; i++){
-				LRU[i] = (char*)malloc(MAXLINE * sizeof(char));
-				LRU_file_names[i] = (char*)malloc(MAXLINE * sizeof(char));
-				LRU_file_sizes[i] = 0;
-				LRU_hashes[i] = (char*)malloc(MAXLINE * sizeof(char));
-			}
-			lru_initialized = true;
-			cache_mtx.unlock();
-		}
-
 		/*
 			Read the request from the given socket
 		*/
 		char      buf[MAXLINE];
 		bzero(buf, MAXLINE);
-		server_mtx.lock();
-		read(connfd, buf, sizeof(buf));
-		server_mtx.unlock();
+		trace_begin(TRACE_RECV);
+		long int request_size = read(connfd, buf, sizeof(buf) - 1);
+		trace_end(TRACE_RECV);
+		if(request_size > 0){
+			admission_charge(connfd, request_size);
+		}
 
 		if(!strncmp(buf, "GET ", 4)){
-			char* moving_buffer = buf;
-			moving_buffer+=4;
-			char* file_name = strtok(moving_buffer, "\n");
-
-			/*
-				If the file isn't cached the code within the loop is run - otherwise
-				refere to get_cached to see how the Server responds with the cached contents
-			*/
-			cache_mtx.lock();
-			if(!get_cached(connfd, file_name, LRU, LRU_file_names, LRU_file_sizes, LRU_hashes, lru_size, false)){
-				cache_mtx.unlock();
-				FILE* get_file = fopen(file_name, "rb");
-				if(get_file){
-					write_OK(connfd, file_name);
-
-					long int file_size = read_file_size(get_file);
-
-					char* file_buffer = (char*)malloc(sizeof(char)*file_size);
-					fread(file_buffer, file_size, 1, get_file);
-					char* hashed_file = hash_MD5(file_buffer);
-
-					write_size(connfd, file_size);
-
-					write_file(connfd, file_buffer, file_size);
-
-					/*
-						By allowing the lru_index to be incremnted prior to accessing the
-						cache itself, we allow other threads to simulataneously work on
-						the cache with the original thread
-					*/
-					if(lru_size > 0){
-						cache_mtx.lock();
-						int temp_index = lru_index;
-						lru_index++;
-						if(lru_index == lru_size){
-							*(&lru_index) = 0;
-						}
-						cache_mtx.unlock();
-						cache_mtx.lock();
-						sprintf(LRU_file_names[temp_index], "%s", (file_name));
-						LRU_file_sizes[temp_index] = file_size;
-						LRU_hashes[temp_index] = hashed_file;
-						LRU[temp_index] = file_buffer;
-						cache_mtx.unlock();
-					}
-				}
-				else{
-					fprintf(stderr, "GET - File not found %s\n", file_name);
-				}
-				fclose(get_file);
+			serve_get<get_transfer>(connfd, buf + 4, buf + request_size);
+		}
+		else if(!strncmp(buf, "GETC ", 5)){
+			serve_get<getc_transfer>(connfd, buf + 5, buf + request_size);
+		}
+		else if(!strncmp(buf, "PUT ", 4)){
+			serve_put<put_transfer>(connfd, buf + 4, buf + request_size);
+		}
+		else if(!strncmp(buf, "PUTC ", 5)){
+			serve_put<putc_transfer>(connfd, buf + 5, buf + request_size);
+		}
+		else if(!strncmp(buf, "STAT ", 5)){
+			char* file_name = strtok(buf + 5, "\n");
+			if(file_name){
+				stat_file(connfd, file_name);
 			}
 			else{
-				cache_mtx.unlock();
+				write_error(connfd, EINVAL);
 			}
 		}
-		else if (!strncmp(buf, "GETC ", 5)){
-			char* moving_buffer = buf;
-			moving_buffer+=5;
-			char* file_name = strtok(moving_buffer, "\n");
-			cache_mtx.lock();
-			if(!get_cached(connfd, file_name, LRU, LRU_file_names, LRU_file_sizes, LRU_hashes, lru_size, true)){
-				cache_mtx.unlock();
-					FILE* get_file = fopen(file_name, "rb");
-					if(get_file){
-
-						write_OK(connfd, file_name);
-						long int file_size = read_file_size(get_file);
-
-						char *file_buffer = (char*)malloc(sizeof(char)*file_size);
-						fread(file_buffer, file_size, 1, get_file);
-						char* hashed_file = hash_MD5(file_buffer);
-
-						write_size(connfd, file_size);
-
-						/*
-							Same as GET except for this function
-						*/
-						write_hash(connfd, hashed_file);
-
-						write_file(connfd, file_buffer, file_size);
-
-						if(lru_size > 0){
-							cache_mtx.lock();
-							int temp_index = lru_index;
-							lru_index++;
-							if(lru_index == lru_size){
-								*(&lru_index) = 0;
-							}
-							cache_mtx.unlock();
-							cache_mtx.lock();
-							sprintf(LRU_file_names[temp_index], "%s", (file_name));
-							LRU_file_sizes[temp_index] = file_size;
-							LRU_hashes[temp_index] = hashed_file;
-							LRU[temp_index] = file_buffer;
-							cache_mtx.unlock();
-						}
-						fclose(get_file);
-					}
-					else{
-						fprintf(stderr, "GETC - File not found %s\n", file_name);
-					}
-				}
-				else{
-					cache_mtx.unlock();
-				}
+		else if(!strncmp(buf, "LIST", 4) && (buf[4] == ' ' || buf[4] == '\n')){
+			/* "LIST\n" lists everything, "LIST <prefix>\n" only names starting with prefix */
+			char* prefix = buf[4] == ' ' ? strtok(buf + 5, "\n") : NULL;
+			if(!prefix){
+				prefix = (char*)"";
 			}
-			else if(!strncmp(buf, "PUT ", 4)){
-				server_mtx.lock();
-				char* moving_buffer = buf;
-				moving_buffer+=4;
-				char* file_name = strtok(moving_buffer, "\n");
-				FILE* put_file = fopen(file_name, "wb");
-				if(put_file){
-					moving_buffer += strlen(file_name) + 1;
-					char* file_size_string = strtok(moving_buffer, "\n");
-					long int file_size = atoi(file_size_string);
-					moving_buffer += strlen(file_size_string) + 1;
-					char* file_contents = (char*)malloc((file_size+1)*sizeof(char));
-					strncpy(file_contents, moving_buffer, file_size);
-					file_contents[file_size] = '\0';
-					char* hash = hash_MD5(file_contents);
-					fwrite(file_contents, file_size, 1, put_file);
-					cache_mtx.lock();
-					if(!put_cached(file_name, LRU, LRU_file_names, LRU_file_sizes, LRU_hashes,
-						lru_size, false, file_size, hash, file_contents, put_file)){
-						cache_mtx.unlock();
-						if(lru_size > 0){
-							cache_mtx.lock();
-							int temp_index = lru_index;
-							lru_index++;
-							if(lru_index == lru_size){
-								*(&lru_index) = 0;
-							}
-							cache_mtx.unlock();
-							cache_mtx.lock();
-							sprintf(LRU_file_names[temp_index], "%s", (file_name));
-							LRU_file_sizes[temp_index] = file_size;
-							LRU_hashes[temp_index] = hash;
-							LRU[temp_index] = file_contents;
-							cache_mtx.unlock();
-						}
-					}
-					else{
-						cache_mtx.unlock();
-					}
-				}
-				else{
-					perror("Error opening file for writing");
-				}
-				fclose(put_file);
-				server_mtx.unlock();
+			if(write_OK(connfd, prefix)){
+				index_list(connfd, prefix);
 			}
-			else if(!strncmp(buf, "PUTC ", 5)){
-				server_mtx.lock();
-				char* moving_buffer = buf;
-				moving_buffer+=5;
-				char* file_name = strtok(moving_buffer, "\n");
-				moving_buffer += strlen(file_name) + 1;
-				FILE* put_file = fopen(file_name, "wb");
-				if(put_file){
-					char* file_size_string = strtok(moving_buffer, "\n");
-					long int file_size = atoi(file_size_string);
-					moving_buffer += strlen(file_size_string) + 1;
-					char* MD5_digest = strtok(moving_buffer, "\n");
-					moving_buffer += 33;
-					char* file_contents = (char*)malloc((file_size+1)*sizeof(char));
-					strncpy(file_contents, moving_buffer, file_size);
-					file_contents[file_size] = '\0';
-					char* hash = hash_MD5(file_contents);
-					if(!strncmp(hash, MD5_digest, 32)){
-						fwrite(file_contents, file_size, 1, put_file);
-						cache_mtx.lock();
-						if(!put_cached(file_name, LRU, LRU_file_names, LRU_file_sizes, LRU_hashes,
-							lru_size, false, file_size, hash, file_contents, put_file)){
-							cache_mtx.unlock();
-							if(lru_size > 0){
-								cache_mtx.lock();
-								int temp_index = lru_index;
-								lru_index++;
-								if(lru_index == lru_size){
-									*(&lru_index) = 0;
-								}
-								cache_mtx.unlock();
-								cache_mtx.lock();
-								sprintf(LRU_file_names[temp_index], "%s", (file_name));
-								LRU_file_sizes[temp_index] = file_size;
-								LRU_hashes[temp_index] = hash;
-								LRU[temp_index] = file_contents;
-								cache_mtx.unlock();
-							}
-						}
-						else{
-							cache_mtx.unlock();
-						}
-					}
-					else{
-						perror("MD5 does not match");
-					}
-					fclose(put_file);
-				}
-				server_mtx.unlock();
 		}
 		else{
 			printf("Invalid Request");
 		}
 }
 
+/*
+	In async mode (-a) GET, GETC, PUT and PUTC are served by the coroutines
+	below.  They take the same steps as file_server(), but every wait on the
+	client is a co_await on the connection's event loop, and every file
+	operation that may block runs on the offload pool, so neither a slow
+	client nor a cold disk holds on to a thread.
+*/
+
+/* what async_open_get() found for a GET */
+struct async_get_reply
+{
+	int      err;
+	long int file_size;
+	char     hash[2*MD5_DIGEST_LENGTH+1];
+	char*    contents;  /* a small file, read whole */
+	int      fd;        /* a large file, reopened with large_open()... */
+	char*    block;     /* ...and the aligned block it is sent through */
+};
+
+static async<bool> async_write_line(struct async_socket *sock, const char* word, const char* file_name){
+	string line = string(word) + " " + file_name + "\n";
+	co_return co_await async_write_all(sock, line.data(), line.size());
+}
+
+static async<bool> async_write_error(struct async_socket *sock, int err){
+	char error_response[256];
+	int error_response_size = snprintf(error_response, sizeof(error_response), "ERROR (%d): %s\n", err, strerror(err));
+	co_return co_await async_write_all(sock, error_response, error_response_size);
+}
+
+/* runs on the offload pool */
+template<typename Policy>
+static void async_open_get(char* file_name, struct async_get_reply* reply){
+	reply->contents = pack_read(file_name, &reply->file_size, reply->hash);
+	if(reply->contents){
+		return;
+	}
+	reply->fd = open(file_name, O_RDONLY);
+	if(reply->fd < 0){
+		reply->err = errno;
+		return;
+	}
+	struct stat file_stat;
+	if(fstat(reply->fd, &file_stat) < 0){
+		reply->err = errno;
+		close(reply->fd);
+		reply->fd = -1;
+		return;
+	}
+	reply->file_size = file_stat.st_size;
+	if(large_io_wanted(reply->file_size)){
+		/* the offload pool can't wait for a block: the coroutines holding them need it to finish */
+		close(reply->fd);
+		reply->block = large_block_take();
+		reply->fd = reply->block ? large_open(file_name, O_RDONLY) : -1;
+		reply->err = reply->fd < 0 ? errno : 0;
+		trace_begin(TRACE_HASH);
+		if(!reply->err && Policy::checksum::enabled && !large_digest(reply->fd, reply->file_size, reply->hash)){
+			reply->err = EIO;
+		}
+		trace_end(TRACE_HASH);
+		if(reply->err){
+			if(reply->fd >= 0){
+				close(reply->fd);
+				reply->fd = -1;
+			}
+			if(reply->block){
+				large_block_put(reply->block);
+				reply->block = NULL;
+			}
+		}
+		return;
+	}
+
+	reply->contents = slab_alloc(reply->file_size + 1);
+	long int received = 0;
+	trace_begin(TRACE_DISK_READ);
+	while(reply->contents && received < reply->file_size){
+		long int count = pread(reply->fd, reply->contents + received, reply->file_size - received, received);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			break;
+		}
+		received += count;
+	}
+	trace_end(TRACE_DISK_READ);
+	close(reply->fd);
+	reply->fd = -1;
+	if(received < reply->file_size){
+		reply->err = reply->contents ? EIO : ENOMEM;
+		slab_free(reply->contents);
+		reply->contents = NULL;
+		return;
+	}
+	reply->contents[reply->file_size] = '\0';
+	trace_begin(TRACE_HASH);
+	Policy::checksum::reply_digest(reply->contents, reply->file_size, reply->hash);
+	trace_end(TRACE_HASH);
+}
+
+template<typename Policy>
+static async<void> async_get(struct async_socket *sock, char* file_name, struct get_conditions* conditions,
+	bool conditional){
+	prefetch_note(sock->fd, file_name);
+	if(cache_missing(file_name)){
+		co_await async_write_error(sock, ENOENT);
+		co_return;
+	}
+	if(conditional && not_modified(file_name, conditions)){
+		co_await async_write_line(sock, "NOTMODIFIED", file_name);
+		co_return;
+	}
+	/* the coroutine may be parked mid-send for as long as its client likes, so it sends a copy */
+	struct async_get_reply reply = { 0, 0, "", NULL, -1, NULL };
+	unsigned long filled = 0;
+	reply.contents = copy_cached(file_name, &reply.file_size, reply.hash, &filled);
+	bool cached = reply.contents != NULL;
+	if(cached && Policy::checksum::enabled && !reply.hash[0]){
+		/* cached by a plain GET, which had no use for the digest */
+		co_await async_offload([&]{
+			trace_begin(TRACE_HASH);
+			Policy::checksum::reply_digest(reply.contents, reply.file_size, reply.hash);
+			trace_end(TRACE_HASH);
+			cache_note_digest(file_name, filled, reply.hash);
+		});
+	}
+	if(!cached){
+		unsigned long generation = cache_missing_generation();
+		co_await async_offload([&]{ async_open_get<Policy>(file_name, &reply); });
+		if(reply.err){
+			fprintf(stderr, "GET - Error opening %s: %s\n", file_name, strerror(reply.err));
+			if(reply.err == ENOENT){
+				cache_note_missing(file_name, generation);
+			}
+			co_await async_write_error(sock, reply.err);
+			co_return;
+		}
+	}
+
+	char* wire = reply.contents;
+	long int wire_size = reply.fd >= 0 ? reply.file_size : Policy::compression::encode(reply.contents, reply.file_size, &wire);
+	string header = string("OK ") + file_name + "\n";
+	header.append((char*)&wire_size, sizeof(wire_size));
+	if(Policy::checksum::enabled){
+		header.append(reply.hash, 2*MD5_DIGEST_LENGTH);
+	}
+	bool sent = co_await async_write_all(sock, header.data(), header.size());
+	if(reply.fd >= 0){
+		if(sent){
+			sent = co_await async_send_large(sock, reply.fd, reply.file_size, reply.block);
+		}
+		large_block_put(reply.block);
+		close(reply.fd);
+	}
+	else{
+		if(sent){
+			sent = co_await async_write_all(sock, wire, wire_size);
+		}
+		if(cached){
+			slab_free(reply.contents);
+		}
+		else{
+			cache_insert(file_name, reply.file_size, reply.hash, reply.contents);
+		}
+	}
+	if(sent){
+		admission_charge(sock->fd, reply.file_size);
+		if(cached){
+			printf("Cached\n");
+		}
+	}
+}
+
+/*
+	A large upload is taken a block at a time: the block is filled from the
+	client on the loop, then written and hashed on the offload pool
+*/
+template<typename Policy>
+static async<void> async_put_large(struct async_socket *sock, char* file_name, long int file_size, char* body,
+	long int body_in_buffer, char* MD5_digest){
+	/* like put_large(), it is received into a temporary file and renamed into place */
+	string temp_name(strlen(file_name) + 128, '\0');
+	temp_path(file_name, "put", &temp_name[0], temp_name.size());
+	/* the offload pool can't wait for a block: the coroutines holding them need it to finish */
+	char* block = large_block_take();
+	if(!block){
+		co_await async_write_error(sock, errno);
+		co_return;
+	}
+	int fd = -1;
+	int err = 0;
+	co_await async_offload([&]{
+		fd = large_open(temp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL);
+		err = fd < 0 ? errno : 0;
+	});
+	if(fd < 0){
+		perror("Error opening file for writing");
+		large_block_put(block);
+		co_await async_write_error(sock, err);
+		co_return;
+	}
+
+	MD5_CTX mdContext;
+	MD5_Init(&mdContext);
+	long int in_block = body_in_buffer < file_size ? body_in_buffer : file_size;
+	memcpy(block, body, in_block);
+	long int written = 0;
+	while(written < file_size){
+		long int wanted = file_size - written < LARGE_IO_BLOCK ? file_size - written : LARGE_IO_BLOCK;
+		while(in_block < wanted){
+			long int count = co_await async_read_some(sock, block + in_block, wanted - in_block);
+			if(count <= 0){
+				err = EPIPE;
+				break;
+			}
+			in_block += count;
+		}
+		if(err){
+			break;
+		}
+		co_await async_offload([&]{
+			trace_begin(TRACE_DISK_WRITE);
+			err = large_write_block(fd, block, written, in_block);
+			trace_end(TRACE_DISK_WRITE);
+			MD5_Update(&mdContext, block, in_block);
+		});
+		if(err){
+			break;
+		}
+		written += in_block;
+		in_block = 0;
+	}
+	large_block_put(block);
+
+	char hash[2*MD5_DIGEST_LENGTH+1];
+	co_await async_offload([&]{
+		if(!err){
+			md5_final_hex(&mdContext, hash);
+			if(!Policy::checksum::verify(hash, MD5_digest)){
+				perror("MD5 does not match");
+				err = EBADMSG;
+			}
+		}
+		if(!err && Policy::durability::enabled){
+			trace_begin(TRACE_FLUSH);
+			err = durability_commit(fd, NULL);
+			trace_end(TRACE_FLUSH);
+		}
+		if(close(fd) < 0 && !err){
+			err = errno;
+		}
+		if(!err){
+			err = install_put<typename Policy::durability>(temp_name.c_str(), file_name);
+		}
+		if(err){
+			unlink(temp_name.c_str());
+		}
+	});
+	if(err){
+		co_await async_write_error(sock, err);
+		co_return;
+	}
+	cache_forget_missing(file_name);
+	cache_remove(file_name);
+	index_update(file_name, file_size, hash);
+	admission_charge(sock->fd, file_size);
+	co_await async_write_line(sock, "OK", file_name);
+}
+
+template<typename Policy>
+static async<void> async_put(struct async_socket *sock, char* file_name, long int file_size, char* body,
+	long int body_in_buffer, char* MD5_digest){
+	if(large_io_wanted(file_size)){
+		co_await async_put_large<Policy>(sock, file_name, file_size, body, body_in_buffer, MD5_digest);
+		co_return;
+	}
+	char* file_contents = slab_alloc((file_size+1)*sizeof(char));
+	if(!file_contents){
+		co_await async_write_error(sock, ENOMEM);
+		co_return;
+	}
+	long int received = body_in_buffer < file_size ? body_in_buffer : file_size;
+	memcpy(file_contents, body, received);
+	while(received < file_size){
+		long int count = co_await async_read_some(sock, file_contents + received, file_size - received);
+		if(count <= 0){
+			slab_free(file_contents);
+			co_await async_write_error(sock, EPIPE);
+			co_return;
+		}
+		received += count;
+	}
+	file_contents[file_size] = '\0';
+
+	int err = 0;
+	co_await async_offload([&]{ err = store_put<Policy>(file_name, file_size, file_contents, MD5_digest); });
+	if(err){
+		co_await async_write_error(sock, err);
+	}
+	else{
+		co_await async_write_line(sock, "OK", file_name);
+	}
+}
+
+/*
+ * async_file_server() - file_server() for async mode.  The request is only
+ *                       peeked at first, so that anything other than a GET,
+ *                       GETC, PUT or PUTC can still be handed to
+ *                       file_server() untouched.  A proxy's GETs go that way
+ *                       too, since a miss there waits on the upstream fetch.
+ */
+async<void> async_file_server(struct async_socket *sock){
+	const int MAXLINE = 8192;
+
+	/* a loop only ever works on one coroutine at a time, so they can share this */
+	static thread_local char peeked[MAXLINE];
+	long int request_size = co_await async_read_some(sock, peeked, MAXLINE - 1, MSG_PEEK);
+	if(request_size <= 0){
+		co_return;
+	}
+	peeked[request_size] = '\0';
+	bool get = !strncmp(peeked, "GET ", 4) || !strncmp(peeked, "GETC ", 5);
+	bool put = !strncmp(peeked, "PUT ", 4) || !strncmp(peeked, "PUTC ", 5);
+	if(!put && (!get || upstream_enabled())){
+		co_await async_fallback(sock);
+		co_return;
+	}
+
+	/* what was peeked is already there, so this doesn't wait */
+	char* buf = slab_alloc(request_size + 1);
+	if(!buf){
+		co_await async_write_error(sock, ENOMEM);
+		co_return;
+	}
+	request_size = co_await async_read_some(sock, buf, request_size);
+	if(request_size <= 0){
+		slab_free(buf);
+		co_return;
+	}
+	buf[request_size] = '\0';
+	admission_charge(sock->fd, request_size);
+
+	bool checksum = buf[3] == 'C';
+	char* saveptr;
+	trace_begin(TRACE_PARSE);
+	char* file_name = strtok_r(buf + (checksum ? 5 : 4), "\n", &saveptr);
+	if(get){
+		struct get_conditions conditions;
+		bool conditional = file_name &&
+			parse_conditions(file_name + strlen(file_name) + 1, buf + request_size, &conditions);
+		trace_end(TRACE_PARSE);
+		if(file_name && checksum){
+			co_await async_get<getc_transfer>(sock, file_name, &conditions, conditional);
+		}
+		else if(file_name){
+			co_await async_get<get_transfer>(sock, file_name, &conditions, conditional);
+		}
+		else{
+			co_await async_write_error(sock, EINVAL);
+		}
+	}
+	else{
+		char* file_size_string = file_name ? strtok_r(NULL, "\n", &saveptr) : NULL;
+		char* MD5_digest = checksum && file_size_string ? strtok_r(NULL, "\n", &saveptr) : NULL;
+		long int file_size = file_size_string ? atol(file_size_string) : -1;
+		trace_end(TRACE_PARSE);
+		if(file_size < 0 || (checksum && (!MD5_digest || strlen(MD5_digest) != 2*MD5_DIGEST_LENGTH))){
+			co_await async_write_error(sock, EINVAL);
+		}
+		else{
+			char* last = checksum ? MD5_digest : file_size_string;
+			char* body = last + strlen(last) + 1;
+			long int body_in_buffer = body < buf + request_size ? request_size - (body - buf) : 0;
+			if(checksum){
+				co_await async_put<putc_transfer>(sock, file_name, file_size, body, body_in_buffer, MD5_digest);
+			}
+			else{
+				co_await async_put<put_transfer>(sock, file_name, file_size, body, body_in_buffer, MD5_digest);
+			}
+		}
+	}
+	slab_free(buf);
+}
+
 /*
  * main() - parse command line, create a socket, handle requests
  */
@@ -545,25 +1393,164 @@ int main(int argc, char **argv)
 	int  lru_size = 10;
 	int  port     = 9000;
 	bool multithread = false;
+	struct admission_config limits = { 32, 128, 500, 0, 0 };
+	enum durability_mode durable = DURABLE_NONE;
+	int  commit_window = 2000;
+	int  commit_batch  = 64;
+	long large_threshold = 64L << 20;
+	int  large_blocks  = 16;
+	int  snapshot_interval = 60;
+	int  warm_readers  = 4;
+	char *control_path = NULL;
+	bool hot_restart = false;
+	int  index_threads = 4;
+	int  missing_names = 1024;
+	int  missing_ttl   = 1000;
+	int  trace_events  = 0;
+	struct async_config async_limits = { 0, 16, 16384, IDLE_TIMEOUT };
+	long pack_threshold = 0;
+	int  prefetch_budget = 0;
 
 	check_team(argv[0]);
 
 	/* parse the command-line options.  They are 'p' for port number,  */
 	/* and 'l' for lru cache size, 'm' for multi-threaded.  'h' is also supported. */
-	while((opt = getopt(argc, argv, "hml:p:")) != -1)
+	/* 'C', 'q', 'd', 'r' and 'b' configure admission control. */
+	/* 'D', 'W' and 'B' configure durable PUTs, 'T' and 'A' large-file I/O. */
+	/* 's' and 'w' configure cache snapshots and warm-up, 'U' and 'H' hot restart. */
+	/* 'i' sets the threads building the metadata index, 'n' and 'N' the negative cache. */
+	/* 'u' names the upstream server of a caching proxy, and 't' turns tracing on. */
+	/* 'a' and 'o' size the event loops and offload pool of async mode, and 'k' turns on packing. */
+	/* 'P' turns on prefetching of files that usually follow the one asked for. */
+	while((opt = getopt(argc, argv, "hml:p:C:q:d:r:b:D:W:B:T:A:s:w:U:Hi:n:N:u:t:a:o:k:P:")) != -1)
 	{
 		switch(opt)
 		{
 		case 'h': help(argv[0]); break;
-		case 'l': lru_size = atoi(argv[0]); break;
+		case 'l': lru_size = atoi(optarg); break;
 		case 'm': multithread = true;	break;
 		case 'p': port = atoi(optarg); break;
+		case 'C': limits.max_conns = async_limits.max_conns = atoi(optarg); break;
+		case 'q': limits.queue_len = atoi(optarg); break;
+		case 'd': limits.deadline_ms = atoi(optarg); break;
+		case 'r': limits.req_rate = atof(optarg); break;
+		case 'b': limits.byte_rate = atof(optarg); break;
+		case 'D':
+			if(!strcmp(optarg, "syncfs")){
+				durable = DURABLE_SYNCFS;
+			}
+			else if(!strcmp(optarg, "fdatasync")){
+				durable = DURABLE_FDATASYNC;
+			}
+			else{
+				die("Unknown durability mode: ", optarg);
+			}
+			break;
+		case 'W': commit_window = atoi(optarg); break;
+		case 'B': commit_batch = atoi(optarg); break;
+		case 'T': large_threshold = atol(optarg); break;
+		case 'A': large_blocks = atoi(optarg); break;
+		case 's': snapshot_interval = atoi(optarg); break;
+		case 'w': warm_readers = atoi(optarg); break;
+		case 'U': control_path = optarg; break;
+		case 'H': hot_restart = true; break;
+		case 'i': index_threads = atoi(optarg); break;
+		case 'n': missing_names = atoi(optarg); break;
+		case 'N': missing_ttl = atoi(optarg); break;
+		case 't': trace_events = atoi(optarg); break;
+		case 'a': async_limits.loops = atoi(optarg); break;
+		case 'o': async_limits.offload_threads = atoi(optarg); break;
+		case 'k': pack_threshold = atol(optarg); break;
+		case 'P': prefetch_budget = atoi(optarg); break;
+		case 'u':
+			if(!upstream_init(optarg)){
+				exit(1);
+			}
+			break;
 		}
 	}
+	block_server_signals(SIG_BLOCK);
+	trace_init(trace_events);
+	durability_init(durable, commit_window, commit_batch);
+	large_io_init(large_threshold, large_blocks);
 
-	/* open a socket, and start handling requests */
-	int fd = open_server_socket(port);
-	handle_requests(fd, file_server, lru_size, multithread);
+	/* start serving right away while the index is built and the last run's hot files load in the background */
+	index_build(index_threads);
+	cache_init(lru_size);
+	cache_missing_init(missing_names, missing_ttl);
+	if(snapshot_interval > 0){
+		thread(snapshot_periodically, snapshot_interval).detach();
+	}
 
-	exit(0);
+	/* the event loops take the place of the worker pool */
+	if(async_limits.loops > 0){
+		async_init(&async_limits, async_file_server, file_server, lru_size);
+		multithread = false;
+	}
+
+	/*
+		A client hanging up mid-reply must not take the server down with it, and
+		SIGUSR1 should interrupt accept() rather than be restarted under it
+	*/
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction stats_action;
+	memset(&stats_action, 0, sizeof(stats_action));
+	stats_action.sa_handler = request_stats;
+	sigaction(SIGUSR1, &stats_action, NULL);
+	struct sigaction trace_action;
+	memset(&trace_action, 0, sizeof(trace_action));
+	trace_action.sa_handler = request_trace;
+	sigaction(SIGUSR2, &trace_action, NULL);
+	struct sigaction shutdown_action;
+	memset(&shutdown_action, 0, sizeof(shutdown_action));
+	shutdown_action.sa_handler = request_shutdown;
+	sigaction(SIGTERM, &shutdown_action, NULL);
+	sigaction(SIGINT, &shutdown_action, NULL);
+
+	/* open a socket (or inherit the running server's), and start handling requests */
+	int fd = -1;
+	if(hot_restart && control_path){
+		fd = restart_takeover(control_path);
+	}
+	if(fd < 0){
+		fd = open_server_socket(port);
+	}
+	if(control_path){
+		restart_listen(control_path, fd);
+	}
+
+	/*
+		The packed files are recovered in the background, since a server
+		taking over has to wait for the old one to drain and let go of the
+		log, and it must be accepting meanwhile.  Requests that need the log
+		wait for it, and so do warm loads of any hot files that are packed.
+	*/
+	pack_init(pack_threshold);
+	cache_warm_start(CACHE_SNAPSHOT, warm_readers);
+
+	/* there is nowhere to prefetch into without the cache */
+	prefetch_init(lru_size > 0 ? prefetch_budget : 0);
+	handle_requests(fd, file_server, lru_size, multithread, &limits);
+
+	/*
+		graceful shutdown: finish the transfers already accepted, hand the cache
+		to the process that took over (if any), and remember what was hot for
+		the next start
+	*/
+	bool drained = async_enabled() ? async_drain(DRAIN_TIMEOUT) : !multithread || admission_drain(DRAIN_TIMEOUT);
+	if(!drained){
+		fprintf(stderr, "Shutting down with transfers still active after %d s\n", DRAIN_TIMEOUT);
+	}
+	restart_finish();
+	pack_checkpoint();
+	cache_save_snapshot(CACHE_SNAPSHOT);
+	print_stats();
+
+	/*
+		The detached helper threads are still parked on their condition
+		variables, and running static destructors under them would block, so
+		skip straight to the exit
+	*/
+	fflush(stdout);
+	_exit(0);
 }
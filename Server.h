@@ -15,8 +15,15 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <mutex>
 #include "support.h"
 
+/*
+ * server_mtx serialises PUTs, and copies fetched from upstream, with the
+ * cache, index and pack updates that go with them
+ */
+extern std::mutex server_mtx;
+
 /*
  * help() - Print a help message
  */
@@ -37,10 +44,38 @@ int open_server_socket(int port);
 /*
  * handle_requests() - given a listening file descriptor, continually wait
  *                     for a request to come in, and when it arrives, pass it
- *                     to service_function.  Note that this is not a
- *                     multi-threaded server.
+ *                     through admission control to service_function.  In
+ *                     multithreading mode a fixed pool of workers serves the
+ *                     admitted connections, and in async mode the event loops
+ *                     do.  Returns once asked to shut down.
+ */
+struct admission_config;
+void handle_requests(int listenfd, void (*service_function)(int, int), int param, bool multithread,
+	struct admission_config *limits);
+
+/*
+ * hash_MD5() - return a NUL-terminated 32-character hex MD5 digest of
+ *              file_size bytes, in request scratch memory (see arena_alloc())
+ */
+char* hash_MD5(char* file_contents, long int file_size);
+
+/*
+ * read_file_size() - return the size of an open file, and rewind it
+ */
+long int read_file_size(FILE* file);
+
+/*
+ * temp_path() - name a hidden temporary file, unique to this call, in the
+ *               same directory as file_name (so it can be renamed over it)
+ *               for the given purpose, e.g. "put".  path needs room for
+ *               file_name plus 128 bytes.
+ */
+void temp_path(const char* file_name, const char* purpose, char* path, size_t size);
+
+/*
+ * write_error() - send "ERROR (#): <strerror>" for the given errno value
  */
-void handle_requests(int listenfd, void (*service_function)(int, int), int param, bool multithread);
+bool write_error(int connfd, int err);
 
 /*
  * file_server() - Read a request from a socket, satisfy the request, and
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Trace.h"
+using namespace std;
+
+bool trace_enabled = false;
+
+struct trace_ring
+{
+	uint32_t            tid;
+	atomic<uint64_t>    head;
+	struct trace_event *events;
+};
+
+static int ring_size = 0;
+static mutex rings_mtx;
+static vector<struct trace_ring *> rings;
+static thread_local struct trace_ring *ring = NULL;
+static thread_local uint64_t current_request = 0;
+static atomic<uint64_t> next_request(1);
+
+/* contended acquisitions of server_mtx and cache_mtx, counted whether or not tracing is on */
+#define TRACED_LOCKS 2
+
+struct lock_profile
+{
+	atomic<long> contended;
+	atomic<long> wait_ns;
+	atomic<long> max_wait_ns;
+};
+
+static struct lock_profile profiles[TRACED_LOCKS];
+static const char *const lock_names[TRACED_LOCKS] = { "server_mtx", "cache_mtx" };
+
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_init(int size){
+	ring_size = size > 0 ? size : 0;
+	trace_enabled = ring_size > 0;
+}
+
+/* a thread's ring is made the first time it records, and lives as long as the process */
+static struct trace_ring *thread_ring(){
+	if(!ring){
+		ring = new trace_ring();
+		ring->tid = syscall(SYS_gettid);
+		ring->head = 0;
+		ring->events = (struct trace_event *)calloc(ring_size, sizeof(struct trace_event));
+		rings_mtx.lock();
+		rings.push_back(ring);
+		rings_mtx.unlock();
+	}
+	return ring;
+}
+
+void trace_record(enum trace_type type, enum trace_phase phase){
+	struct trace_ring *r = thread_ring();
+	uint64_t head = r->head.load(memory_order_relaxed);
+	struct trace_event *event = &r->events[head % ring_size];
+	event->ts_ns = now_ns();
+	event->request = current_request;
+	event->tid = r->tid;
+	event->type = type;
+	event->phase = phase;
+	r->head.store(head + 1, memory_order_release);
+}
+
+uint64_t trace_request(){
+	if(trace_enabled){
+		current_request = next_request++;
+	}
+	return current_request;
+}
+
+void trace_resume(uint64_t request){
+	if(trace_enabled){
+		current_request = request;
+	}
+}
+
+uint64_t trace_current(){
+	return current_request;
+}
+
+void trace_lock(mutex &mtx, enum trace_type wait_type){
+	enum trace_type hold_type = (enum trace_type)(wait_type + 1);
+	if(mtx.try_lock()){
+		trace_begin(hold_type);
+		return;
+	}
+	uint64_t start = now_ns();
+	trace_begin(wait_type);
+	mtx.lock();
+	trace_end(wait_type);
+	trace_begin(hold_type);
+
+	long waited = now_ns() - start;
+	struct lock_profile *profile = &profiles[(wait_type - TRACE_WAIT_SERVER_MTX) / 2];
+	profile->contended++;
+	profile->wait_ns += waited;
+	long longest = profile->max_wait_ns.load();
+	while(waited > longest && !profile->max_wait_ns.compare_exchange_weak(longest, waited)){
+	}
+}
+
+bool trace_dump(const char *path){
+	if(!trace_enabled){
+		fprintf(stderr, "%s", "Tracing is off, nothing to dump\n");
+		return false;
+	}
+	vector<struct trace_event> events;
+	rings_mtx.lock();
+	for(struct trace_ring *r : rings){
+		uint64_t head = r->head.load(memory_order_acquire);
+		uint64_t oldest = head > (uint64_t)ring_size ? head - ring_size : 0;
+		for(uint64_t i = oldest; i < head; i++){
+			events.push_back(r->events[i % ring_size]);
+		}
+	}
+	rings_mtx.unlock();
+
+	string temp_path = string(path) + ".tmp";
+	FILE *dump = fopen(temp_path.c_str(), "wb");
+	if(!dump){
+		perror("Error writing trace");
+		return false;
+	}
+	struct trace_header header;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.count = events.size();
+	bool written = fwrite(&header, sizeof(header), 1, dump) == 1 &&
+		fwrite(events.data(), sizeof(struct trace_event), events.size(), dump) == events.size();
+	if(fclose(dump) != 0 || !written || rename(temp_path.c_str(), path) < 0){
+		perror("Error writing trace");
+		unlink(temp_path.c_str());
+		return false;
+	}
+	fprintf(stderr, "trace: %zu events from %zu threads written to %s\n", events.size(), rings.size(), path);
+	return true;
+}
+
+void trace_print_stats(FILE *out){
+	for(int i = 0; i < TRACED_LOCKS; i++){
+		long contended = profiles[i].contended.load();
+		fprintf(out, "locks: %s waited for %ld times, %.3f ms in total, longest %.3f ms\n", lock_names[i],
+			contended, profiles[i].wait_ns.load() / 1e6, profiles[i].max_wait_ns.load() / 1e6);
+	}
+}
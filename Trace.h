@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+
+/*
+ * What a span measures.  Every span has a begin and an end event; the
+ * request span encloses the others recorded for the same request.
+ */
+enum trace_type
+{
+	TRACE_REQUEST,
+	TRACE_RECV,
+	TRACE_PARSE,
+	TRACE_CACHE_LOOKUP,
+	TRACE_DISK_READ,
+	TRACE_DISK_WRITE,
+	TRACE_HASH,
+	TRACE_SEND,
+	TRACE_FLUSH,
+	TRACE_UPSTREAM,
+	TRACE_WAIT_SERVER_MTX,
+	TRACE_HOLD_SERVER_MTX,
+	TRACE_WAIT_CACHE_MTX,
+	TRACE_HOLD_CACHE_MTX,
+	TRACE_TYPES
+};
+
+static const char *const trace_names[TRACE_TYPES] = {
+	"request", "recv", "parse", "cache lookup", "disk read", "disk write", "hash", "send", "flush",
+	"upstream", "wait server_mtx", "hold server_mtx", "wait cache_mtx", "hold cache_mtx"
+};
+
+enum trace_phase
+{
+	TRACE_BEGIN,
+	TRACE_END
+};
+
+/*
+ * One event as recorded in a thread's ring, and as written to a dump
+ */
+struct trace_event
+{
+	uint64_t ts_ns;
+	uint64_t request;
+	uint32_t tid;
+	uint16_t type;
+	uint16_t phase;
+};
+
+/*
+ * A dump is this header followed by count events, grouped by thread and
+ * oldest first within each thread
+ */
+#define TRACE_MAGIC "FSTRACE1"
+
+struct trace_header
+{
+	char     magic[8];
+	uint64_t count;
+};
+
+extern bool trace_enabled;
+
+/*
+ * trace_init() - give every thread that records a ring of ring_size
+ *                events.  A ring_size of 0 leaves tracing off, and every
+ *                hook below then costs a single test.
+ */
+void trace_init(int ring_size);
+
+/*
+ * trace_record() - append an event to this thread's ring
+ */
+void trace_record(enum trace_type type, enum trace_phase phase);
+
+/*
+ * trace_request() - start a new request on this thread, so that the spans
+ *                   recorded until the next one are tagged with its id.
+ *                   Returns the id, or 0 with tracing off.
+ */
+uint64_t trace_request();
+
+/*
+ * trace_resume() - tag the spans recorded on this thread with request
+ *                  again, for a request that moves between threads
+ */
+void trace_resume(uint64_t request);
+
+/*
+ * trace_current() - the id of the request this thread is recording for
+ */
+uint64_t trace_current();
+
+static inline void trace_begin(enum trace_type type){
+	if(trace_enabled){
+		trace_record(type, TRACE_BEGIN);
+	}
+}
+
+static inline void trace_end(enum trace_type type){
+	if(trace_enabled){
+		trace_record(type, TRACE_END);
+	}
+}
+
+/*
+ * trace_lock() - lock mtx, counting how often and for how long it had to
+ *                be waited for, and recording the wait and the hold as spans
+ *                wait_type and wait_type + 1
+ */
+void trace_lock(std::mutex &mtx, enum trace_type wait_type);
+
+/*
+ * trace_unlock() - unlock a mutex taken with trace_lock()
+ */
+static inline void trace_unlock(std::mutex &mtx, enum trace_type wait_type){
+	mtx.unlock();
+	trace_end((enum trace_type)(wait_type + 1));
+}
+
+/*
+ * trace_dump() - write every thread's ring to path, for TraceJson to
+ *                convert.  Threads keep recording while it runs, so an event
+ *                being overwritten at that moment may come out torn.
+ */
+bool trace_dump(const char *path);
+
+/*
+ * trace_print_stats() - dump lock contention counts and wait times
+ */
+void trace_print_stats(FILE *out);
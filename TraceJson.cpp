@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "support.h"
+#include "Trace.h"
+using namespace std;
+
+void help(char *progname)
+{
+	printf("Usage: %s [OPTIONS] <TRACE FILE>\n", progname);
+	printf("Convert a trace dumped by the server on SIGUSR2 to Chrome trace JSON\n");
+	printf("  -o    file to write the JSON to (default <TRACE FILE>.json)\n");
+	printf("Load the result in chrome://tracing or https://ui.perfetto.dev\n");
+}
+
+void die(const char *msg1, const char *msg2)
+{
+	fprintf(stderr, "%s, %s\n", msg1, msg2);
+	exit(1);
+}
+
+/*
+ * main() - read the dump, and write one Chrome "B"/"E" event per trace
+ *          event, with timestamps in microseconds from the oldest event
+ */
+int main(int argc, char **argv)
+{
+	long  opt;
+	char *output_name = NULL;
+
+	check_team(argv[0]);
+
+	while((opt = getopt(argc, argv, "ho:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'h': help(argv[0]); exit(0);
+			case 'o': output_name = optarg; break;
+		}
+	}
+	if(optind >= argc){
+		help(argv[0]);
+		exit(1);
+	}
+
+	FILE *dump = fopen(argv[optind], "rb");
+	if(!dump){
+		die("Error opening trace: ", argv[optind]);
+	}
+	struct trace_header header;
+	if(fread(&header, sizeof(header), 1, dump) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))){
+		die("Not a trace dump: ", argv[optind]);
+	}
+	vector<struct trace_event> events(header.count);
+	if(fread(events.data(), sizeof(struct trace_event), header.count, dump) != header.count){
+		die("Trace dump is truncated: ", argv[optind]);
+	}
+	fclose(dump);
+
+	/* not standard output, which check_team() has already written to */
+	string default_name = string(argv[optind]) + ".json";
+	if(!output_name){
+		output_name = (char *)default_name.c_str();
+	}
+	FILE *out = fopen(output_name, "w");
+	if(!out){
+		die("Error opening output: ", output_name);
+	}
+	uint64_t origin = UINT64_MAX;
+	for(struct trace_event &event : events){
+		if(event.ts_ns < origin){
+			origin = event.ts_ns;
+		}
+	}
+
+	/*
+		A ring that wrapped starts part way through some spans, so an end with
+		no begin before it on its thread is dropped
+	*/
+	map<uint32_t, int> depth;
+	bool first = true;
+	long int written = 0;
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for(struct trace_event &event : events){
+		if(event.type >= TRACE_TYPES){
+			continue;
+		}
+		if(event.phase == TRACE_END){
+			if(depth[event.tid] == 0){
+				continue;
+			}
+			depth[event.tid]--;
+		}
+		else{
+			depth[event.tid]++;
+		}
+		fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"request\":%llu}}",
+			first ? "" : ",\n", trace_names[event.type], event.phase == TRACE_BEGIN ? "B" : "E",
+			(event.ts_ns - origin) / 1000.0, event.tid, (unsigned long long)event.request);
+		first = false;
+		written++;
+	}
+	fprintf(out, "\n]}\n");
+	if(fclose(out) != 0){
+		die("Error writing output: ", output_name);
+	}
+	printf("%ld events written to %s\n", written, output_name);
+	exit(0);
+}
@@ -0,0 +1,368 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <openssl/md5.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "Cache.h"
+#include "Index.h"
+#include "LargeIO.h"
+#include "Memory.h"
+#include "Pack.h"
+#include "Pipeline.h"
+#include "Server.h"
+#include "Trace.h"
+#include "Upstream.h"
+using namespace std;
+
+/* Seconds the upstream may go quiet mid-fetch before the fetch is abandoned */
+#define UPSTREAM_TIMEOUT 10
+
+/* Bytes moved from the upstream socket to the temporary file at a time */
+#define UPSTREAM_BLOCK (64 * 1024)
+
+struct upstream_fetch
+{
+	string             file_name;
+	mutex              mtx;
+	condition_variable progress;
+	int                users;
+	int                fd;
+	bool               have_header;
+	long int           file_size;
+	char               hash[2*MD5_DIGEST_LENGTH+1];
+	long int           received;
+	bool               done;
+	int                err;
+	unsigned long      generation;  /* of missing names, when the miss that started it was seen */
+};
+
+static char upstream_host[256];
+static char upstream_port[16];
+static bool enabled = false;
+
+/* fetches in flight, so that concurrent misses for one file share a fetch */
+static mutex fetches_mtx;
+static map<string, struct upstream_fetch *> fetches;
+
+static atomic<long> fetched(0);
+static atomic<long> coalesced(0);
+static atomic<long> failed(0);
+static atomic<long> fetched_bytes(0);
+static atomic<long> superseded(0);
+
+bool upstream_init(const char *host_port){
+	const char *colon = strrchr(host_port, ':');
+	if(!colon || colon == host_port || (size_t)(colon - host_port) >= sizeof(upstream_host) ||
+		atoi(colon + 1) <= 0){
+		fprintf(stderr, "Upstream must be host:port, not %s\n", host_port);
+		return false;
+	}
+	memcpy(upstream_host, host_port, colon - host_port);
+	upstream_host[colon - host_port] = '\0';
+	snprintf(upstream_port, sizeof(upstream_port), "%d", atoi(colon + 1));
+	enabled = true;
+	return true;
+}
+
+bool upstream_enabled(){
+	return enabled;
+}
+
+static int connect_upstream(){
+	struct addrinfo hints, *addresses;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	int err = getaddrinfo(upstream_host, upstream_port, &hints, &addresses);
+	if(err){
+		fprintf(stderr, "Upstream DNS error for %s: %s\n", upstream_host, gai_strerror(err));
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd >= 0 && connect(fd, addresses->ai_addr, addresses->ai_addrlen) < 0){
+		perror("Error connecting to upstream");
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	if(fd >= 0){
+		struct timeval timeout = { UPSTREAM_TIMEOUT, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+	return fd;
+}
+
+static bool read_all(int fd, char *data, long int size){
+	while(size > 0){
+		long int count = read(fd, data, size);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			return false;
+		}
+		data += count;
+		size -= count;
+	}
+	return true;
+}
+
+/*
+	The reply line is read a byte at a time so the binary size that follows
+	stays in the socket.  Returns 0 for "OK", or the errno of an error line.
+*/
+static int read_reply(int fd){
+	char line[8192];
+	long int received = 0;
+	while(received < (long int)sizeof(line) - 1){
+		if(!read_all(fd, line + received, 1)){
+			return EIO;
+		}
+		if(line[received++] == '\n'){
+			break;
+		}
+	}
+	line[received] = '\0';
+	if(!strncmp(line, "OK ", 3)){
+		return 0;
+	}
+	int err;
+	if(sscanf(line, "ERROR (%d)", &err) == 1 && err > 0){
+		return err;
+	}
+	return EIO;
+}
+
+static void publish(struct upstream_fetch *fetch, long int received, bool done, int err){
+	fetch->mtx.lock();
+	fetch->received = received;
+	fetch->done = done;
+	fetch->err = err;
+	fetch->mtx.unlock();
+	fetch->progress.notify_all();
+}
+
+/*
+	Pull the file into a dot-file beside where it belongs (the index skips
+	those), and only rename it into place once it is complete and its MD5
+	checks out, so local readers never see a partial copy.  GETC is asked
+	for because its reply carries the MD5 before the body, which lets a GETC
+	client be streamed to as well.
+*/
+static int pull(struct upstream_fetch *fetch){
+	const char *file_name = fetch->file_name.c_str();
+	int connfd = connect_upstream();
+	if(connfd < 0){
+		return EHOSTUNREACH;
+	}
+	string request = "GETC " + fetch->file_name + "\n";
+	if(write(connfd, request.data(), request.size()) != (ssize_t)request.size()){
+		close(connfd);
+		return EIO;
+	}
+	int err = read_reply(connfd);
+	long int file_size;
+	char hash[2*MD5_DIGEST_LENGTH+1];
+	if(!err && (!read_all(connfd, (char *)&file_size, sizeof(file_size)) || file_size < 0 ||
+		!read_all(connfd, hash, 2*MD5_DIGEST_LENGTH))){
+		err = EIO;
+	}
+	if(err){
+		close(connfd);
+		return err;
+	}
+	hash[2*MD5_DIGEST_LENGTH] = '\0';
+
+	/* beside the file, so the rename stays on one filesystem whatever directory it is in */
+	char temp_name[strlen(file_name) + 128];
+	temp_path(file_name, "upstream", temp_name, sizeof(temp_name));
+	int fd = open(temp_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0){
+		err = errno;
+		perror("Error creating upstream copy");
+		close(connfd);
+		return err;
+	}
+	fetch->mtx.lock();
+	fetch->fd = fd;
+	fetch->file_size = file_size;
+	strcpy(fetch->hash, hash);
+	fetch->have_header = true;
+	fetch->mtx.unlock();
+	fetch->progress.notify_all();
+
+	/* small files are kept for the LRU cache on the way through, as a local GET would */
+	char *contents = large_io_wanted(file_size) ? NULL : slab_alloc(file_size + 1);
+	char *block = (char *)malloc(UPSTREAM_BLOCK);
+	MD5_CTX mdContext;
+	MD5_Init(&mdContext);
+	long int received = 0;
+	while(!err && received < file_size){
+		long int wanted = file_size - received < UPSTREAM_BLOCK ? file_size - received : UPSTREAM_BLOCK;
+		long int count = read(connfd, block, wanted);
+		if(count < 0 && errno == EINTR){
+			continue;
+		}
+		if(count <= 0){
+			err = EIO;
+			break;
+		}
+		if(pwrite(fd, block, count, received) != count){
+			err = errno ? errno : EIO;
+			break;
+		}
+		MD5_Update(&mdContext, block, count);
+		if(contents){
+			memcpy(contents + received, block, count);
+		}
+		received += count;
+		publish(fetch, received, false, 0);
+	}
+	free(block);
+	close(connfd);
+
+	if(!err){
+		char calculated[2*MD5_DIGEST_LENGTH+1];
+		md5_final_hex(&mdContext, calculated);
+		if(strcmp(calculated, hash)){
+			fprintf(stderr, "Upstream copy of %s doesn't match its MD5\n", file_name);
+			err = EBADMSG;
+		}
+	}
+	if(err){
+		unlink(temp_name);
+		slab_free(contents);
+		return err;
+	}
+	fetched_bytes += file_size;
+
+	/*
+		A PUT since the miss has newer contents than upstream, so the copy is
+		installed under server_mtx, like a PUT, and only if none has come
+		through and nothing has appeared under the name meanwhile
+	*/
+	trace_lock(server_mtx, TRACE_WAIT_SERVER_MTX);
+	bool stale = cache_missing_generation() != fetch->generation || access(file_name, F_OK) == 0;
+	bool unpacked = false;
+	if(!stale){
+		err = pack_install(temp_name, file_name, &unpacked);
+	}
+	if(stale || err){
+		trace_unlock(server_mtx, TRACE_WAIT_SERVER_MTX);
+		unlink(temp_name);
+		slab_free(contents);
+		if(stale){
+			superseded++;
+		}
+		return err;
+	}
+	cache_forget_missing(file_name);
+	index_update(file_name, file_size, hash);
+	if(contents){
+		contents[file_size] = '\0';
+		cache_insert(file_name, file_size, hash, contents);
+	}
+	trace_unlock(server_mtx, TRACE_WAIT_SERVER_MTX);
+	return 0;
+}
+
+static void fetcher(struct upstream_fetch *fetch){
+	int err = pull(fetch);
+	if(err){
+		failed++;
+	}
+	publish(fetch, fetch->received, true, err);
+
+	/* later misses find the local copy, or start afresh after a failure */
+	fetches_mtx.lock();
+	fetches.erase(fetch->file_name);
+	fetches_mtx.unlock();
+	upstream_leave(fetch);
+}
+
+struct upstream_fetch *upstream_join(const char *file_name, unsigned long generation){
+	lock_guard<mutex> lock(fetches_mtx);
+	auto it = fetches.find(file_name);
+	if(it != fetches.end()){
+		struct upstream_fetch *fetch = it->second;
+		fetch->mtx.lock();
+		fetch->users++;
+		fetch->mtx.unlock();
+		coalesced++;
+		return fetch;
+	}
+	struct upstream_fetch *fetch = new upstream_fetch();
+	fetch->file_name = file_name;
+	fetch->users = 2;  /* the caller and the fetcher */
+	fetch->fd = -1;
+	fetch->have_header = false;
+	fetch->file_size = 0;
+	fetch->hash[0] = '\0';
+	fetch->received = 0;
+	fetch->done = false;
+	fetch->err = 0;
+	fetch->generation = generation;
+	fetches[file_name] = fetch;
+	fetched++;
+	thread(fetcher, fetch).detach();
+	return fetch;
+}
+
+int upstream_wait_header(struct upstream_fetch *fetch, long int *file_size, char *hash){
+	unique_lock<mutex> lock(fetch->mtx);
+	fetch->progress.wait(lock, [fetch]{ return fetch->have_header || fetch->done; });
+	if(!fetch->have_header){
+		return fetch->err;
+	}
+	*file_size = fetch->file_size;
+	strcpy(hash, fetch->hash);
+	return 0;
+}
+
+long int upstream_read(struct upstream_fetch *fetch, long int offset, char *buffer, long int size){
+	unique_lock<mutex> lock(fetch->mtx);
+	fetch->progress.wait(lock, [fetch, offset]{ return fetch->received > offset || fetch->done; });
+	if(fetch->err){
+		return -1;
+	}
+	long int available = fetch->received - offset;
+	int fd = fetch->fd;
+	lock.unlock();
+	if(available <= 0){
+		return 0;
+	}
+	return pread(fd, buffer, available < size ? available : size, offset);
+}
+
+void upstream_leave(struct upstream_fetch *fetch){
+	fetch->mtx.lock();
+	bool last = --fetch->users == 0;
+	fetch->mtx.unlock();
+	if(last){
+		if(fetch->fd >= 0){
+			close(fetch->fd);
+		}
+		delete fetch;
+	}
+}
+
+void upstream_print_stats(FILE *out){
+	if(!enabled){
+		return;
+	}
+	fprintf(out, "upstream: %ld fetches (%ld failed, %ld bytes), %ld misses coalesced into a fetch in flight\n",
+		fetched.load(), failed.load(), fetched_bytes.load(), coalesced.load());
+	fprintf(out, "upstream: %ld fetched copies dropped because the file was written here meanwhile\n", superseded.load());
+}
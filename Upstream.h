@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * A file being pulled from the upstream server.  It lands in a temporary
+ * file next to the local copy, and every connection waiting for it reads
+ * that file as it grows, so one fetch serves all of them.
+ */
+struct upstream_fetch;
+
+/*
+ * upstream_init() - fetch local misses from the server at host_port
+ *                   ("host:port").  Returns false if it can't be parsed.
+ */
+bool upstream_init(const char *host_port);
+
+/*
+ * upstream_enabled() - true if local misses go upstream
+ */
+bool upstream_enabled();
+
+/*
+ * upstream_join() - follow the fetch of file_name already in flight, or
+ *                   start one.  generation is cache_missing_generation() as
+ *                   read before the miss: the fetched copy is only kept if
+ *                   no PUT has come through since.  Every join needs an
+ *                   upstream_leave().
+ */
+struct upstream_fetch *upstream_join(const char *file_name, unsigned long generation);
+
+/*
+ * upstream_wait_header() - block until the upstream has sent the size and
+ *                          MD5 of the file.  Returns 0, or the errno the
+ *                          fetch failed with.
+ */
+int upstream_wait_header(struct upstream_fetch *fetch, long int *file_size, char *hash);
+
+/*
+ * upstream_read() - copy up to size bytes at offset, blocking until the
+ *                   upstream has sent them.  Returns the count, or -1 if the
+ *                   fetch failed before getting that far.
+ */
+long int upstream_read(struct upstream_fetch *fetch, long int offset, char *buffer, long int size);
+
+/*
+ * upstream_leave() - stop following fetch
+ */
+void upstream_leave(struct upstream_fetch *fetch);
+
+/*
+ * upstream_print_stats() - dump fetch and coalescing counts
+ */
+void upstream_print_stats(FILE *out);